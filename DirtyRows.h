@@ -0,0 +1,138 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <algorithm>
+#include <limits>
+#include <utility>
+#include <vector>
+
+#include <tree_sitter/api.h>
+
+// Rows whose entries in an index built off the tree (LocalsIndex,
+// ErrorIndex) are out of date. Edits and changed ranges only mark rows here,
+// and the index looks at them again once a new tree comes in. The spans
+// follow the edits that come in before then, so they still cover the same
+// text.
+class DirtyRows {
+  public:
+    // a span ending here runs to the end of the buffer
+    static constexpr size_t all_rows = std::numeric_limits<size_t>::max();
+
+    using RowSpan = std::pair<size_t, size_t>; // inclusive on both ends
+
+    // rows [start_row, old_end_row] became [start_row, new_end_row]
+    struct RowEdit {
+        size_t start_row;
+        size_t old_end_row;
+        size_t new_end_row;
+
+        explicit RowEdit(TSInputEdit const &edit)
+            : start_row(edit.start_point.row),
+              old_end_row(edit.old_end_point.row),
+              new_end_row(edit.new_end_point.row) {
+        }
+
+        // where a row after the edit ends up
+        size_t shift(size_t row) const {
+            return row - old_end_row + new_end_row;
+        }
+
+        // moves [first_row, last_row] along with the text it covered; a span
+        // touching the edit grows to cover all of it
+        void shift_span(size_t &first_row, size_t &last_row) const {
+            if (last_row < start_row) {
+                return;
+            }
+            if (first_row > old_end_row) {
+                first_row = shift(first_row);
+                last_row = shift(last_row);
+                return;
+            }
+            first_row = std::min(first_row, start_row);
+            if (last_row == all_rows) {
+                return;
+            }
+            // anything ending inside the edit now ends where the edit does
+            last_row =
+                (last_row >= old_end_row) ? shift(last_row) : new_end_row;
+        }
+    };
+
+  private:
+    std::vector<RowSpan> spans;
+
+  public:
+    DirtyRows() {
+    }
+
+    bool empty() const {
+        return spans.empty();
+    }
+
+    void mark(size_t first_row, size_t last_row) {
+        spans.push_back({first_row, last_row});
+    }
+
+    // everything, e.g. for a brand new tree
+    void mark_all() {
+        spans = {{0, all_rows}};
+    }
+
+    // shifts every span past the edit, and marks the rows it touched
+    void apply_edit(RowEdit const &edit) {
+        for (auto &[first_row, last_row] : spans) {
+            edit.shift_span(first_row, last_row);
+        }
+        mark(edit.start_row, edit.new_end_row);
+    }
+
+    // the spans sorted, with overlapping and adjacent ones merged; nothing
+    // is dirty afterwards
+    std::vector<RowSpan> take_merged() {
+        std::sort(spans.begin(), spans.end());
+        std::vector<RowSpan> merged;
+        for (RowSpan span : spans) {
+            if (merged.empty()) {
+                merged.push_back(span);
+            } else if (merged.back().second == all_rows) {
+                break;
+            } else if (span.first <= merged.back().second + 1) {
+                merged.back().second =
+                    std::max(merged.back().second, span.second);
+            } else {
+                merged.push_back(span);
+            }
+        }
+        spans.clear();
+        return merged;
+    }
+
+    // calls fn on each child of node touching rows [first_row, last_row],
+    // in order. Children before first_row are skipped over without being
+    // looked at.
+    template <typename Fn>
+    static void for_each_child_within(TSNode node, size_t first_row,
+                                      size_t last_row, Fn &&fn) {
+        TSTreeCursor tree_cursor = ts_tree_cursor_new(node);
+        if (ts_tree_cursor_goto_first_child_for_point(
+                &tree_cursor, TSPoint{.row = (uint32_t)first_row,
+                                      .column = 0}) == -1) {
+            ts_tree_cursor_delete(&tree_cursor);
+            return;
+        }
+
+        do {
+            TSNode child = ts_tree_cursor_current_node(&tree_cursor);
+            if (ts_node_start_point(child).row > last_row) {
+                break;
+            }
+            if (ts_node_end_point(child).row < first_row) {
+                continue;
+            }
+            fn(child);
+        } while (ts_tree_cursor_goto_next_sibling(&tree_cursor));
+        ts_tree_cursor_delete(&tree_cursor);
+    }
+};
@@ -0,0 +1,83 @@
+#pragma once
+
+#include <stddef.h>
+
+#include <optional>
+#include <string>
+#include <string_view>
+
+#include "File.h"
+#include "Json.h"
+
+// editor-wide settings from the "editor" section of the config
+struct EditorConfig {
+    // renders per second at most; 0 means render after every batch of input
+    int max_fps;
+    // long rows wrap onto the next screen row, or else scroll sideways
+    bool soft_wrap;
+    // when wrapping, break rows after spaces instead of at the edge
+    bool wrap_at_words;
+    // buffers that cost more than this many bytes to snapshot for the parse
+    // worker only get a window around the viewport parsed. Small enough that
+    // copying a buffer under it every frame goes unnoticed.
+    size_t parse_window_bytes;
+
+    EditorConfig()
+        : max_fps(120),
+          soft_wrap(true),
+          wrap_at_words(false),
+          parse_window_bytes(1024 * 1024) {
+    }
+
+    // entries missing from the config keep their defaults. Returns false if
+    // the file couldn't be used.
+    bool load_config(std::string_view filename) {
+        File config_file{filename};
+        if (config_file.get_mode() == File::Mode::SCRATCH ||
+            config_file.get_mode() == File::Mode::UNREADABLE) {
+            return false;
+        }
+
+        std::optional<std::string> contents = config_file.get_file_contents();
+        if (!contents) {
+            return false;
+        }
+
+        std::optional<JsonValue> config = JsonParser::parse(*contents);
+        if (!config) {
+            return false;
+        }
+
+        JsonValue const *editor = config->get("editor");
+        if (!editor || !editor->is_object()) {
+            return false;
+        }
+
+        if (JsonValue const *fps = editor->get("max_fps");
+            fps && fps->is_number() && fps->number >= 0) {
+            max_fps = (int)fps->number;
+        }
+        if (JsonValue const *wrap = editor->get("soft_wrap");
+            wrap && wrap->is_bool()) {
+            soft_wrap = wrap->boolean;
+        }
+        if (JsonValue const *words = editor->get("wrap_at_words");
+            words && words->is_bool()) {
+            wrap_at_words = words->boolean;
+        }
+        if (JsonValue const *window = editor->get("parse_window_bytes");
+            window && window->is_number() && window->number >= 0) {
+            parse_window_bytes = (size_t)window->number;
+        }
+        return true;
+    }
+
+    static EditorConfig const &get() {
+        static EditorConfig config = []() {
+            EditorConfig ec;
+            ec.load_config("configs/config.json");
+            return ec;
+        }();
+        return config;
+    }
+};
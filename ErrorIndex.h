@@ -0,0 +1,201 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <algorithm>
+#include <iterator>
+#include <optional>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include <tree_sitter/api.h>
+
+#include "DirtyRows.h"
+
+// Sorted index of the ERROR and MISSING nodes in the tree, for jumping
+// between syntax errors and underlining them. Edits and changed ranges only
+// mark rows dirty, and rebuild() only looks for errors on those rows.
+// Subtrees without errors are never descended into (ts_node_has_error), so
+// even a huge file costs little to scan.
+class ErrorIndex {
+    static constexpr size_t all_rows = DirtyRows::all_rows;
+
+  public:
+    // end is exclusive; MISSING nodes are zero width
+    struct Error {
+        TSPoint start_point;
+        TSPoint end_point;
+    };
+
+  private:
+    using RowSpan = DirtyRows::RowSpan;
+
+    std::vector<Error> errors; // sorted by start_point
+    DirtyRows dirty_rows;
+
+  public:
+    ErrorIndex() {
+    }
+
+    size_t size() const {
+        return errors.size();
+    }
+
+    // forgets everything; the next rebuild covers the whole tree
+    void reset() {
+        errors.clear();
+        dirty_rows.mark_all();
+    }
+
+    void mark_dirty(size_t first_row, size_t last_row) {
+        dirty_rows.mark(first_row, last_row);
+    }
+
+    // rows [start, old_end] became [start, new_end]: shift what comes after,
+    // and drop the errors on the rows that were touched
+    void apply_edit(TSInputEdit const &edit) {
+        DirtyRows::RowEdit row_edit{edit};
+        std::erase_if(errors, [&](Error const &error) {
+            return error.start_point.row <= row_edit.old_end_row &&
+                   error.end_point.row >= row_edit.start_row;
+        });
+        for (Error &error : errors) {
+            if (error.start_point.row > row_edit.old_end_row) {
+                error.start_point.row =
+                    (uint32_t)row_edit.shift(error.start_point.row);
+                error.end_point.row =
+                    (uint32_t)row_edit.shift(error.end_point.row);
+            }
+        }
+        dirty_rows.apply_edit(row_edit);
+    }
+
+    // Rescans the dirty rows of the (fresh) tree. Returns the rows whose
+    // errors may have changed.
+    std::vector<RowSpan> rebuild(TSTree const *tree) {
+        std::vector<RowSpan> to_return;
+        // merged, so that every error only gets collected once
+        std::vector<RowSpan> spans = dirty_rows.take_merged();
+
+        TSNode root = ts_tree_root_node(tree);
+        for (auto [first_row, last_row] : spans) {
+            // errors sticking out of the span get collected again in full
+            auto [begin, end] = get_errors_within(first_row, last_row);
+            size_t changed_first_row = first_row;
+            size_t changed_last_row = last_row;
+            if (begin != end) {
+                changed_first_row =
+                    std::min(changed_first_row, (size_t)begin->start_point.row);
+                changed_last_row = std::max(
+                    changed_last_row, (size_t)std::prev(end)->end_point.row);
+            }
+
+            std::vector<Error> new_errors;
+            if (ts_node_has_error(root)) {
+                collect_errors(root, first_row, last_row, new_errors);
+            }
+            if (!new_errors.empty()) {
+                changed_first_row =
+                    std::min(changed_first_row,
+                             (size_t)new_errors.front().start_point.row);
+                changed_last_row = std::max(
+                    changed_last_row, (size_t)new_errors.back().end_point.row);
+            }
+
+            auto insert_pos = errors.erase(begin, end);
+            errors.insert(insert_pos, new_errors.begin(), new_errors.end());
+            to_return.push_back({changed_first_row, changed_last_row});
+        }
+        return to_return;
+    }
+
+    // the errors touching rows [first_row, end_row), in order
+    std::pair<std::vector<Error>::const_iterator,
+              std::vector<Error>::const_iterator>
+    errors_within(size_t first_row, size_t end_row) const {
+        if (end_row == 0) {
+            return {errors.end(), errors.end()};
+        }
+        // errors are sorted by start, but one that starts early can run
+        // long, so the start of the range is a scan back from the first
+        // error starting in it. Errors don't nest, so this stays short.
+        auto end = std::partition_point(
+            errors.begin(), errors.end(), [&](Error const &error) {
+                return error.start_point.row < end_row;
+            });
+        auto begin = std::partition_point(
+            errors.begin(), end, [&](Error const &error) {
+                return error.start_point.row < first_row;
+            });
+        while (begin != errors.begin() &&
+               std::prev(begin)->end_point.row >= first_row) {
+            --begin;
+        }
+        return {begin, end};
+    }
+
+    // the first error starting after point, wrapping around to the first
+    // one in the file
+    std::optional<TSPoint> next_error(TSPoint point) const {
+        if (errors.empty()) {
+            return std::nullopt;
+        }
+        auto it = std::partition_point(
+            errors.begin(), errors.end(), [&](Error const &error) {
+                return !is_before(point, error.start_point);
+            });
+        return (it == errors.end()) ? errors.front().start_point
+                                    : it->start_point;
+    }
+
+    // the last error starting before point, wrapping around to the last one
+    // in the file
+    std::optional<TSPoint> prev_error(TSPoint point) const {
+        if (errors.empty()) {
+            return std::nullopt;
+        }
+        auto it = std::partition_point(
+            errors.begin(), errors.end(), [&](Error const &error) {
+                return is_before(error.start_point, point);
+            });
+        return (it == errors.begin()) ? errors.back().start_point
+                                      : std::prev(it)->start_point;
+    }
+
+  private:
+    static bool is_before(TSPoint a, TSPoint b) {
+        return a.row < b.row || (a.row == b.row && a.column < b.column);
+    }
+
+    std::pair<std::vector<Error>::iterator, std::vector<Error>::iterator>
+    get_errors_within(size_t first_row, size_t last_row) {
+        auto [begin, end] = std::as_const(*this).errors_within(
+            first_row, (last_row == all_rows) ? all_rows : last_row + 1);
+        return {errors.begin() + (begin - errors.cbegin()),
+                errors.begin() + (end - errors.cbegin())};
+    }
+
+    static bool is_error(TSNode node) {
+        return std::string_view{ts_node_type(node)} == "ERROR" ||
+               ts_node_is_missing(node);
+    }
+
+    // appends the errors under node touching [first_row, last_row], in
+    // order. Only descends into children that have errors somewhere.
+    static void collect_errors(TSNode node, size_t first_row, size_t last_row,
+                               std::vector<Error> &to_return) {
+        DirtyRows::for_each_child_within(
+            node, first_row, last_row, [&](TSNode child) {
+                if (is_error(child)) {
+                    // whatever is inside an ERROR is part of the same error
+                    to_return.push_back(
+                        Error{.start_point = ts_node_start_point(child),
+                              .end_point = ts_node_end_point(child)});
+                } else if (ts_node_has_error(child)) {
+                    collect_errors(child, first_row, last_row, to_return);
+                }
+            });
+    }
+};
@@ -1,7 +1,13 @@
 #pragma once
 
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+
 #include <deque>
 #include <iostream>
+#include <mutex>
+#include <optional>
 #include <string>
 
 #include <notcurses/notcurses.h>
@@ -75,27 +81,130 @@ struct EventQueue {
     notcurses *nc_ptr;
     std::deque<Event> event_queue;
 
+    // messages can be posted from other threads (e.g. the parse worker), so
+    // the queue is locked, and a byte written into the pipe wakes up
+    // get_event if it's blocked waiting on input
+    std::mutex queue_mutex;
+    int wakeup_fds[2];
+
+    // input that take_typed_text read but couldn't use
+    std::optional<ncinput> held_input;
+
     EventQueue(notcurses *np)
         : nc_ptr(np) {
+        if (pipe2(wakeup_fds, O_NONBLOCK | O_CLOEXEC) == -1) {
+            wakeup_fds[0] = wakeup_fds[1] = -1;
+        }
     }
 
-    Event get_event() {
-        // has a ref to notcurses to get events?
+    ~EventQueue() {
+        if (wakeup_fds[0] != -1) {
+            close(wakeup_fds[0]);
+            close(wakeup_fds[1]);
+        }
+    }
 
+    EventQueue(EventQueue const &) = delete;
+    EventQueue &operator=(EventQueue const &) = delete;
+
+    // the next event if one is ready, without blocking
+    std::optional<Event> poll_event() {
         // events take higher priority for now
-        if (!event_queue.empty()) {
-            Event e = event_queue.front();
-            event_queue.pop_front();
+        {
+            std::lock_guard lock{queue_mutex};
+            if (!event_queue.empty()) {
+                Event e = event_queue.front();
+                event_queue.pop_front();
+                return e;
+            }
+        }
+
+        if (held_input) {
+            Event e{*held_input};
+            held_input.reset();
             return e;
         }
 
         struct ncinput input;
-        notcurses_get(nc_ptr, nullptr, &input);
-        return Event{input};
+        uint32_t id = notcurses_get_nblock(nc_ptr, &input);
+        if (id != 0 && id != (uint32_t)-1) {
+            return Event{input};
+        }
+        return std::nullopt;
+    }
+
+    // shift and the lock keys still leave a key typing text, so a shifted
+    // capital in a paste doesn't split it; anything else is a shortcut
+    static bool only_text_modifiers(ncinput const &input) {
+        constexpr unsigned text_modifiers =
+            NCKEY_MOD_SHIFT | NCKEY_MOD_CAPSLOCK | NCKEY_MOD_NUMLOCK;
+        return (input.modifiers & ~text_modifiers) == 0;
+    }
+
+    // takes the plain text keys (printable characters, tab and enter) that
+    // are already waiting, up to the first other input, which poll_event
+    // hands out next. A paste arrives as one long run of these, so it can go
+    // in as a single edit. Enter comes back as '\n'.
+    std::string take_typed_text() {
+        std::string text;
+        while (!held_input) {
+            struct ncinput input;
+            uint32_t id = notcurses_get_nblock(nc_ptr, &input);
+            if (id == 0 || id == (uint32_t)-1) {
+                break;
+            }
+            if (!only_text_modifiers(input)) {
+                held_input = input;
+            } else if (input.id >= 32 && input.id <= 255) {
+                text.push_back((char)input.id);
+            } else if (input.id == NCKEY_TAB) {
+                text.push_back('\t');
+            } else if (input.id == NCKEY_ENTER) {
+                text.push_back('\n');
+            } else {
+                held_input = input;
+            }
+        }
+        return text;
+    }
+
+    // sleeps until either input or a message might be ready, or timeout_ms
+    // passes (-1 waits forever). Returns false if it timed out.
+    bool wait_for_event(int timeout_ms) {
+        pollfd fds[2] = {
+            {.fd = notcurses_inputready_fd(nc_ptr), .events = POLLIN},
+            {.fd = wakeup_fds[0], .events = POLLIN},
+        };
+        if (poll(fds, 2, timeout_ms) <= 0) {
+            return false;
+        }
+
+        if (fds[1].revents & POLLIN) {
+            char drain[64];
+            while (read(wakeup_fds[0], drain, sizeof(drain)) > 0) {
+            }
+        }
+        return true;
+    }
+
+    Event get_event() {
+        while (true) {
+            if (std::optional<Event> maybe_event = poll_event()) {
+                return *maybe_event;
+            }
+            // nothing ready, sleep until either side has something for us
+            wait_for_event(-1);
+        }
     }
 
     void post_message(std::string_view msg) {
-        event_queue.push_back(msg);
+        {
+            std::lock_guard lock{queue_mutex};
+            event_queue.push_back(msg);
+        }
+        if (wakeup_fds[1] != -1) {
+            [[maybe_unused]] ssize_t ret = write(wakeup_fds[1], "", 1);
+        }
     }
 
     void post_message(std::string_view target, std::string_view payload) {
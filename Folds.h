@@ -0,0 +1,355 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <algorithm>
+#include <optional>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+// Which buffer rows are hidden behind closed folds. A fold keeps its header
+// row on screen and hides the rows below it, up to and including its last
+// row. Folds are kept sorted and disjoint (with at least one visible row
+// between any two), along with how many rows the folds before each one hide,
+// so mapping between buffer rows and on-screen rows is a binary search no
+// matter how many rows the folds cover.
+class FoldSet {
+    struct Fold {
+        size_t first_hidden; // the header is the row right above
+        size_t last_hidden;  // inclusive
+        size_t hidden_before;
+
+        size_t header() const {
+            return first_hidden - 1;
+        }
+
+        size_t num_hidden() const {
+            return last_hidden - first_hidden + 1;
+        }
+    };
+
+  public:
+    // [header, last] rows, inclusive
+    using RowRange = std::pair<size_t, size_t>;
+
+  private:
+    // how many fold and unfold changes_since can look back over
+    static constexpr size_t max_changes = 32;
+
+    std::vector<Fold> folds;
+    // bumped whenever some row gets hidden or shown
+    uint64_t version;
+    // the rows each of the latest versions hid or showed, oldest first. Edits
+    // move rows around, so they start the log over.
+    std::vector<std::pair<uint64_t, RowRange>> changes;
+    // the oldest version changes_since can catch up from
+    uint64_t changes_start_version;
+
+  public:
+    FoldSet()
+        : version(0),
+          changes_start_version(0) {
+    }
+
+    bool empty() const {
+        return folds.empty();
+    }
+
+    uint64_t get_version() const {
+        return version;
+    }
+
+    void clear() {
+        if (!folds.empty()) {
+            record_change(folds.front().first_hidden, folds.back().last_hidden);
+        }
+        folds.clear();
+    }
+
+    // the rows (inclusive) that got hidden or shown since since_version, an
+    // older version than the current one. nullopt if that's too far back to
+    // tell, or there was an edit since.
+    std::optional<RowRange> changes_since(uint64_t since_version) const {
+        if (since_version < changes_start_version) {
+            return std::nullopt;
+        }
+        std::optional<RowRange> to_return;
+        for (auto const &[change_version, rows] : changes) {
+            if (change_version <= since_version) {
+                continue;
+            }
+            if (!to_return) {
+                to_return = rows;
+            } else {
+                to_return->first = std::min(to_return->first, rows.first);
+                to_return->second = std::max(to_return->second, rows.second);
+            }
+        }
+        return to_return;
+    }
+
+    // hides (header_row, last_row]; folds already inside get swallowed.
+    // returns false if there was nothing to hide, or the header itself is
+    // hidden
+    bool fold(size_t header_row, size_t last_row) {
+        if (last_row <= header_row || is_hidden(header_row)) {
+            return false;
+        }
+
+        Fold to_insert{.first_hidden = header_row + 1,
+                       .last_hidden = last_row,
+                       .hidden_before = 0};
+
+        // anything starting inside the new fold, or right after it, gets
+        // merged in so that folds never touch
+        auto first_it = std::lower_bound(
+            folds.begin(), folds.end(), to_insert.first_hidden,
+            [](Fold const &f, size_t row) { return f.first_hidden < row; });
+        auto last_it = first_it;
+        while (last_it != folds.end() &&
+               last_it->first_hidden <= to_insert.last_hidden + 1) {
+            to_insert.last_hidden =
+                std::max(to_insert.last_hidden, last_it->last_hidden);
+            ++last_it;
+        }
+
+        auto it = folds.erase(first_it, last_it);
+        it = folds.insert(it, to_insert);
+        recount_from((size_t)(it - folds.begin()));
+        // folds that got swallowed were already hidden
+        record_change(to_insert.first_hidden, to_insert.last_hidden);
+        return true;
+    }
+
+    // removes the fold that either has its header on row, or hides it.
+    // returns false if there wasn't one
+    bool unfold_at(size_t row) {
+        auto it = fold_containing(row + 1);
+        if (it == folds.end() || it->header() > row) {
+            return false;
+        }
+        record_change(it->first_hidden, it->last_hidden);
+        it = folds.erase(it);
+        recount_from((size_t)(it - folds.begin()));
+        return true;
+    }
+
+    bool is_hidden(size_t row) const {
+        return fold_containing(row) != folds.end();
+    }
+
+    bool is_fold_header(size_t row) const {
+        auto it = fold_after(row);
+        return it != folds.end() && it->first_hidden == row + 1;
+    }
+
+    // the row that row shows up as on screen: itself, or the header of the
+    // fold hiding it
+    size_t visible_row_for(size_t row) const {
+        auto it = fold_containing(row);
+        return (it == folds.end()) ? row : it->header();
+    }
+
+    // may return num_lines (or more) if nothing below row is visible
+    size_t next_visible_row(size_t row) const {
+        auto it = fold_containing(row + 1);
+        return (it == folds.end()) ? row + 1 : it->last_hidden + 1;
+    }
+
+    // row must be visible and above the first row
+    size_t prev_visible_row(size_t row) const {
+        return visible_row_for(row - 1);
+    }
+
+    // how many visible rows come before row; hidden rows count as their
+    // header
+    size_t visible_index(size_t row) const {
+        auto it = fold_after(row);
+        if (it == folds.begin()) {
+            return row;
+        }
+        --it;
+        if (row <= it->last_hidden) {
+            return it->header() - it->hidden_before;
+        }
+        return row - it->hidden_before - it->num_hidden();
+    }
+
+    // the inverse of visible_index
+    size_t row_at_visible_index(size_t visible_idx) const {
+        // the last fold whose header comes before the index
+        auto it = std::partition_point(
+            folds.begin(), folds.end(), [=](Fold const &f) {
+                return f.header() - f.hidden_before < visible_idx;
+            });
+        if (it == folds.begin()) {
+            return visible_idx;
+        }
+        --it;
+        return visible_idx + it->hidden_before + it->num_hidden();
+    }
+
+    // rows [start_row, old_end_row] got replaced by [start_row, new_end_row].
+    // folds below the edit move with it, and folds it touched get opened
+    // (typing on a header's own line leaves its fold alone)
+    void apply_edit(size_t start_row, size_t old_end_row, size_t new_end_row) {
+        bool single_line = (start_row == old_end_row) &&
+                           (old_end_row == new_end_row);
+        // just moving folds along doesn't change which rows are hidden
+        if (std::erase_if(folds, [&](Fold const &f) {
+                bool touched =
+                    f.header() <= old_end_row && f.last_hidden >= start_row;
+                bool header_only = single_line && f.header() == start_row;
+                return touched && !header_only;
+            }) > 0) {
+            ++version;
+        }
+        for (Fold &f : folds) {
+            if (f.header() > old_end_row) {
+                f.first_hidden = f.first_hidden + new_end_row - old_end_row;
+                f.last_hidden = f.last_hidden + new_end_row - old_end_row;
+            }
+        }
+        recount_from(0);
+        // the rows logged so far are from before the edit
+        changes.clear();
+        changes_start_version = version;
+    }
+
+  private:
+    void record_change(size_t first_row, size_t last_row) {
+        ++version;
+        if (changes.size() == max_changes) {
+            changes_start_version = changes.front().first;
+            changes.erase(changes.begin());
+        }
+        changes.push_back({version, RowRange{first_row, last_row}});
+    }
+
+    // first fold whose hidden rows start after row
+    std::vector<Fold>::const_iterator fold_after(size_t row) const {
+        return std::upper_bound(
+            folds.begin(), folds.end(), row,
+            [](size_t r, Fold const &f) { return r < f.first_hidden; });
+    }
+
+    std::vector<Fold>::iterator fold_containing(size_t row) {
+        auto it = std::as_const(*this).fold_containing(row);
+        return folds.begin() + (it - folds.cbegin());
+    }
+
+    std::vector<Fold>::const_iterator fold_containing(size_t row) const {
+        auto it = fold_after(row);
+        if (it == folds.begin() || (it - 1)->last_hidden < row) {
+            return folds.end();
+        }
+        return it - 1;
+    }
+
+    void recount_from(size_t idx) {
+        size_t hidden_before =
+            (idx == 0) ? 0
+                       : folds[idx - 1].hidden_before +
+                             folds[idx - 1].num_hidden();
+        for (; idx < folds.size(); ++idx) {
+            folds[idx].hidden_before = hidden_before;
+            hidden_before += folds[idx].num_hidden();
+        }
+    }
+};
+
+// Indentation-based fold ranges, for buffers without a syntax tree. A
+// header is a non-blank row followed by rows indented deeper than it; blank
+// rows in between go along with the fold, but trailing ones don't.
+// T needs at() and num_lines().
+namespace IndentFolds {
+
+// tabs are rendered as 4 columns, so they count as 4 here too
+inline std::optional<size_t> indent_of(std::string_view line) {
+    size_t indent = 0;
+    for (char c : line) {
+        if (c == ' ') {
+            ++indent;
+        } else if (c == '\t') {
+            indent += 4;
+        } else {
+            return indent;
+        }
+    }
+    // blank lines don't have an indent
+    return std::nullopt;
+}
+
+template <typename T>
+std::optional<FoldSet::RowRange> range_from_header(T const &buffer,
+                                                   size_t header_row) {
+    std::optional<size_t> header_indent = indent_of(buffer.at(header_row));
+    if (!header_indent) {
+        return std::nullopt;
+    }
+
+    size_t last_row = header_row;
+    for (size_t row = header_row + 1; row < buffer.num_lines(); ++row) {
+        std::optional<size_t> indent = indent_of(buffer.at(row));
+        if (!indent) {
+            continue;
+        }
+        if (*indent <= *header_indent) {
+            break;
+        }
+        last_row = row;
+    }
+
+    if (last_row == header_row) {
+        return std::nullopt;
+    }
+    return FoldSet::RowRange{header_row, last_row};
+}
+
+// the fold that row heads, or else the innermost one it sits inside of
+template <typename T>
+std::optional<FoldSet::RowRange> fold_range(T const &buffer, size_t row) {
+    if (auto maybe_range = range_from_header(buffer, row)) {
+        return maybe_range;
+    }
+
+    // walk up through rows that are less indented than the last one we
+    // tried; the first one whose fold reaches row is the one we're in
+    std::optional<size_t> limit = indent_of(buffer.at(row));
+    for (size_t header_row = row; header_row-- > 0;) {
+        std::optional<size_t> indent = indent_of(buffer.at(header_row));
+        if (!indent || (limit && *indent >= *limit)) {
+            continue;
+        }
+        auto maybe_range = range_from_header(buffer, header_row);
+        if (maybe_range && maybe_range->second >= row) {
+            return maybe_range;
+        }
+        if (*indent == 0) {
+            break;
+        }
+        limit = indent;
+    }
+    return std::nullopt;
+}
+
+// the outermost folds in the buffer, for folding everything at once
+template <typename T>
+std::vector<FoldSet::RowRange> outermost_fold_ranges(T const &buffer) {
+    std::vector<FoldSet::RowRange> ranges;
+    size_t row = 0;
+    while (row < buffer.num_lines()) {
+        auto maybe_range = range_from_header(buffer, row);
+        if (!maybe_range) {
+            ++row;
+            continue;
+        }
+        ranges.push_back(*maybe_range);
+        row = maybe_range->second + 1;
+    }
+    return ranges;
+}
+
+} // namespace IndentFolds
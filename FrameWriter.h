@@ -0,0 +1,143 @@
+#pragma once
+
+#include <errno.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+
+#include <notcurses/notcurses.h>
+
+// Gets rendered frames onto the terminal from its own thread.
+//
+// The main thread has notcurses turn the planes into the escape sequences
+// for a frame (ncpile_render_to_buffer), which leaves it with a buffer that
+// doesn't point back into any plane. This thread only ever sees those
+// buffers, so the main thread is free to draw into (or destroy) planes for
+// the next frame while the slow part, writing to the terminal, happens here.
+class FrameWriter {
+    // a frame's bytes, malloc'd by notcurses
+    struct Frame {
+        char *data;
+        size_t size;
+    };
+
+    ncplane *pile_ptr;
+    int out_fd;
+
+    std::mutex mtx;
+    std::condition_variable cv;
+    // frames waiting to be written, oldest first. Each one only draws what
+    // changed since the one before, so none of them can be skipped.
+    std::deque<Frame> pending_frames;
+    // set while a frame taken off the queue is being written
+    bool writing;
+    bool stopping;
+
+    std::thread writer_thread;
+
+    // how far the terminal may fall behind before submit() waits for it
+    static constexpr size_t max_pending_frames = 2;
+
+  public:
+    // notcurses was set up to write to stdout
+    explicit FrameWriter(ncplane *pile, int fd = STDOUT_FILENO)
+        : pile_ptr(pile),
+          out_fd(fd),
+          writing(false),
+          stopping(false) {
+        writer_thread = std::thread(&FrameWriter::run, this);
+    }
+
+    ~FrameWriter() {
+        {
+            std::lock_guard lock{mtx};
+            stopping = true;
+        }
+        cv.notify_all();
+        writer_thread.join();
+    }
+
+    FrameWriter(FrameWriter const &) = delete;
+    FrameWriter(FrameWriter &&) = delete;
+    FrameWriter &operator=(FrameWriter const &) = delete;
+    FrameWriter &operator=(FrameWriter &&) = delete;
+
+    // turns the planes as they are now into a frame and queues it to be
+    // written. Nothing of the planes is looked at once this returns.
+    void submit() {
+        Frame frame{.data = nullptr, .size = 0};
+        if (ncpile_render_to_buffer(pile_ptr, &frame.data, &frame.size) != 0) {
+            free(frame.data);
+            return;
+        }
+        if (frame.size == 0) {
+            free(frame.data);
+            return;
+        }
+
+        std::unique_lock lock{mtx};
+        cv.wait(lock, [this]() {
+            return pending_frames.size() < max_pending_frames;
+        });
+        pending_frames.push_back(frame);
+        lock.unlock();
+        cv.notify_all();
+    }
+
+    // blocks until everything submitted is on the terminal
+    void wait_until_written() {
+        std::unique_lock lock{mtx};
+        cv.wait(lock, [this]() { return pending_frames.empty() && !writing; });
+    }
+
+  private:
+    void run() {
+        while (true) {
+            Frame frame;
+            {
+                std::unique_lock lock{mtx};
+                cv.wait(lock, [this]() {
+                    return stopping || !pending_frames.empty();
+                });
+                // whatever's pending still gets written, so the screen is
+                // up to date when we stop
+                if (pending_frames.empty()) {
+                    return;
+                }
+                frame = pending_frames.front();
+                pending_frames.pop_front();
+                writing = true;
+            }
+            cv.notify_all();
+
+            write_all(frame);
+            free(frame.data);
+
+            {
+                std::lock_guard lock{mtx};
+                writing = false;
+            }
+            cv.notify_all();
+        }
+    }
+
+    // a terminal that can't be written to just misses the frame
+    void write_all(Frame const &frame) {
+        size_t written = 0;
+        while (written < frame.size) {
+            ssize_t res =
+                write(out_fd, frame.data + written, frame.size - written);
+            if (res < 0 && errno == EINTR) {
+                continue;
+            }
+            if (res <= 0) {
+                return;
+            }
+            written += (size_t)res;
+        }
+    }
+};
@@ -0,0 +1,540 @@
+#pragma once
+
+#include <ctype.h>
+#include <stddef.h>
+
+#include <dlfcn.h>
+
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include <tree_sitter/api.h>
+
+#include "File.h"
+#include "Highlighter.h"
+#include "Json.h"
+#include "LineHighlighter.h"
+#include "LocalsIndex.h"
+#include "QueryPredicates.h"
+
+typedef TSLanguage *(*parser_fn_ptr_t)(void);
+
+// RAII-based wrapper for dynamically linked functions
+struct DLFunc {
+    std::string symbol_name; // file name of where the shared library is
+    void *handle;            // the handle returned by dlopen
+    parser_fn_ptr_t fn_ptr;
+
+    std::string errmsg;
+    DLFunc(std::string_view filename, std::string_view s_name)
+        : symbol_name(s_name),
+          handle(nullptr),
+          fn_ptr(nullptr) {
+        // do a dl open here
+        handle = dlopen(std::string(filename).c_str(), RTLD_LAZY);
+        // need to handle the errors gracefully (maybe eventually with logging?)
+        if (!handle) {
+            // dlsym on a null handle would search the global namespace
+            errmsg = dlerror();
+            return;
+        }
+
+        fn_ptr = (::parser_fn_ptr_t)dlsym(handle, symbol_name.c_str());
+    }
+
+    DLFunc(DLFunc const &) = delete;
+    DLFunc(DLFunc &&) = delete;
+    DLFunc &operator=(DLFunc const &) = delete;
+    DLFunc &operator=(DLFunc &&) = delete;
+
+    ~DLFunc() {
+        if (handle) {
+            dlclose(handle);
+        }
+    }
+
+    ::parser_fn_ptr_t get_parser_fn_ptr() {
+        return fn_ptr;
+    }
+};
+
+// Everything we know about one language. The description comes from the
+// config; the shared library and the query only get loaded the first time a
+// buffer actually uses the grammar, and are then shared by every buffer.
+struct Grammar {
+    std::string name; // shown in the status bar
+    std::string library_path;
+    std::string symbol_name;
+    std::string highlights_path;
+    std::string locals_path; // empty if the grammar has no locals.scm
+    std::vector<std::string> extensions; // without the leading '.'
+    std::vector<std::string> filenames;  // whole names, like "Makefile"
+    std::vector<std::string> shebangs;   // interpreter names
+    std::vector<std::string> modelines;  // vim ft= / emacs mode: names
+
+    // filled in by load()
+    bool load_attempted = false;
+    std::unique_ptr<DLFunc> dl_func;
+    TSLanguage const *language = nullptr;
+    TSQuery *highlights_query = nullptr; // nullptr means no highlighting
+    // capture id -> Highlighter style id
+    std::vector<uint16_t> capture_styles;
+    QueryPredicates highlights_predicates;
+    // nullptr means references don't get resolved to their definitions
+    TSQuery *locals_query = nullptr;
+    LocalsCaptures locals_captures;
+    QueryPredicates locals_predicates;
+
+    Grammar() {
+    }
+
+    Grammar(Grammar const &) = delete;
+    Grammar &operator=(Grammar const &) = delete;
+
+    ~Grammar() {
+        if (highlights_query) {
+            ts_query_delete(highlights_query);
+        }
+        if (locals_query) {
+            ts_query_delete(locals_query);
+        }
+    }
+
+    bool is_loaded() const {
+        return language != nullptr;
+    }
+
+    // dlopens the grammar and compiles its queries, once. Returns false if
+    // the grammar can't be used.
+    bool load() {
+        if (load_attempted) {
+            return is_loaded();
+        }
+        load_attempted = true;
+
+        dl_func = std::make_unique<DLFunc>(library_path, symbol_name);
+        parser_fn_ptr_t parser_fn_ptr = dl_func->get_parser_fn_ptr();
+        if (!parser_fn_ptr) {
+            return false;
+        }
+        language = parser_fn_ptr();
+
+        // either query stays nullptr if it's missing or doesn't compile, in
+        // which case we just go without
+        highlights_query = load_query(highlights_path);
+        if (highlights_query) {
+            capture_styles =
+                Highlighter::get().resolve_capture_styles(highlights_query);
+            highlights_predicates = QueryPredicates{highlights_query};
+        }
+
+        locals_query = load_query(locals_path);
+        if (locals_query) {
+            locals_captures = LocalsCaptures{locals_query};
+            locals_predicates = QueryPredicates{locals_query};
+        }
+        return true;
+    }
+
+  private:
+    TSQuery *load_query(std::string_view query_path) const {
+        if (query_path.empty()) {
+            return nullptr;
+        }
+        File queries_file{query_path};
+        if (queries_file.get_mode() == File::Mode::SCRATCH ||
+            queries_file.get_mode() == File::Mode::UNREADABLE) {
+            return nullptr;
+        }
+        std::optional<std::string> query_string =
+            queries_file.get_file_contents();
+        if (!query_string) {
+            return nullptr;
+        }
+
+        TSQueryError error_type;
+        uint32_t error_offset;
+        return ts_query_new(language, query_string->data(),
+                            (uint32_t)query_string->size(), &error_offset,
+                            &error_type);
+    }
+};
+
+// Maps file names, shebangs and modelines onto grammars, and onto the regex
+// line syntaxes used for files that no grammar matches. Building this only
+// reads the config; nothing gets dlopened until Grammar::load().
+class GrammarRegistry {
+    // these get handed out by pointer, so they can't move around
+    std::vector<std::unique_ptr<Grammar>> grammars;
+    std::vector<std::unique_ptr<LineSyntax>> line_syntaxes;
+
+    // whether the config had a "grammars" section, even an empty one
+    bool has_grammars_config = false;
+
+    // how many lines at either end of a file we look at for modelines
+    static constexpr size_t modeline_search_lines = 5;
+
+  public:
+    GrammarRegistry() {
+    }
+
+    GrammarRegistry(GrammarRegistry const &) = delete;
+    GrammarRegistry &operator=(GrammarRegistry const &) = delete;
+    GrammarRegistry(GrammarRegistry &&) = default;
+
+    // replaces (or adds) a grammar by name
+    Grammar *add_grammar(std::string_view name, std::string_view library_path,
+                         std::string_view symbol_name,
+                         std::string_view highlights_path,
+                         std::string_view locals_path,
+                         std::vector<std::string> extensions,
+                         std::vector<std::string> shebangs,
+                         std::vector<std::string> modelines) {
+        auto grammar = std::make_unique<Grammar>();
+        grammar->name = name;
+        grammar->library_path = library_path;
+        grammar->symbol_name = symbol_name;
+        grammar->highlights_path = highlights_path;
+        grammar->locals_path = locals_path;
+        grammar->extensions = std::move(extensions);
+        grammar->shebangs = std::move(shebangs);
+        grammar->modelines = std::move(modelines);
+
+        for (auto &existing : grammars) {
+            if (existing->name == name) {
+                // nobody can be holding on to it yet, we only get configured
+                // before the first lookup
+                existing = std::move(grammar);
+                return existing.get();
+            }
+        }
+        grammars.push_back(std::move(grammar));
+        return grammars.back().get();
+    }
+
+    // replaces (or adds) a line syntax by name
+    LineSyntax *add_line_syntax(std::string_view name,
+                                std::vector<std::string> extensions,
+                                std::vector<std::string> filenames,
+                                std::vector<std::string> shebangs,
+                                std::vector<std::string> modelines,
+                                std::vector<LineSyntax::State> states) {
+        auto syntax = std::make_unique<LineSyntax>();
+        syntax->name = name;
+        syntax->extensions = std::move(extensions);
+        syntax->filenames = std::move(filenames);
+        syntax->shebangs = std::move(shebangs);
+        syntax->modelines = std::move(modelines);
+        syntax->states = std::move(states);
+
+        for (auto &existing : line_syntaxes) {
+            if (existing->name == name) {
+                existing = std::move(syntax);
+                return existing.get();
+            }
+        }
+        line_syntaxes.push_back(std::move(syntax));
+        return line_syntaxes.back().get();
+    }
+
+    // reads the "grammars" and "line_syntaxes" sections of the config.
+    // Returns false if the file couldn't be used.
+    bool load_config(std::string_view filename) {
+        File config_file{filename};
+        if (config_file.get_mode() == File::Mode::SCRATCH ||
+            config_file.get_mode() == File::Mode::UNREADABLE) {
+            return false;
+        }
+
+        std::optional<std::string> contents = config_file.get_file_contents();
+        if (!contents) {
+            return false;
+        }
+
+        std::optional<JsonValue> config = JsonParser::parse(*contents);
+        if (!config) {
+            return false;
+        }
+
+        JsonValue const *grammars_config = config->get("grammars");
+        JsonValue const *line_syntaxes_config = config->get("line_syntaxes");
+        bool has_grammars = grammars_config && grammars_config->is_object();
+        bool has_line_syntaxes =
+            line_syntaxes_config && line_syntaxes_config->is_object();
+        has_grammars_config = has_grammars_config || has_grammars;
+        if (!has_grammars && !has_line_syntaxes) {
+            return false;
+        }
+
+        for (size_t idx = 0;
+             has_grammars && idx < grammars_config->object_keys.size(); ++idx) {
+            JsonValue const &entry = grammars_config->object_values[idx];
+            auto maybe_library = entry.get_string("library");
+            auto maybe_symbol = entry.get_string("symbol");
+            if (!maybe_library || !maybe_symbol) {
+                continue;
+            }
+            Grammar *grammar = add_grammar(
+                grammars_config->object_keys[idx], *maybe_library,
+                *maybe_symbol, entry.get_string("highlights").value_or(""),
+                entry.get_string("locals").value_or(""),
+                get_string_list(entry.get("extensions")),
+                get_string_list(entry.get("shebangs")),
+                get_string_list(entry.get("modelines")));
+            grammar->filenames = get_string_list(entry.get("filenames"));
+        }
+
+        for (size_t idx = 0; has_line_syntaxes &&
+                             idx < line_syntaxes_config->object_keys.size();
+             ++idx) {
+            JsonValue const &entry = line_syntaxes_config->object_values[idx];
+            JsonValue const *states_config = entry.get("states");
+            if (!states_config || !states_config->is_object()) {
+                continue;
+            }
+            add_line_syntax(line_syntaxes_config->object_keys[idx],
+                            get_string_list(entry.get("extensions")),
+                            get_string_list(entry.get("filenames")),
+                            get_string_list(entry.get("shebangs")),
+                            get_string_list(entry.get("modelines")),
+                            get_line_states(*states_config));
+        }
+        return true;
+    }
+
+    Grammar *find_by_name(std::string_view name) const {
+        for (auto const &grammar : grammars) {
+            if (grammar->name == name) {
+                return grammar.get();
+            }
+        }
+        return nullptr;
+    }
+
+    // A modeline wins over a shebang, which wins over the file name, which
+    // wins over the extension. Only the first and last few lines of the
+    // buffer get looked at (T needs num_lines() and at()). Returns nullptr if
+    // nothing matches.
+    template <typename T>
+    Grammar *detect(std::optional<std::string_view> maybe_filename,
+                    T const &buffer) const {
+        return detect_in(grammars, maybe_filename, buffer);
+    }
+
+    // same as detect(), for buffers that no grammar matched
+    template <typename T>
+    LineSyntax *
+    detect_line_syntax(std::optional<std::string_view> maybe_filename,
+                       T const &buffer) const {
+        return detect_in(line_syntaxes, maybe_filename, buffer);
+    }
+
+    // everyone shares the one registry, so grammars get loaded at most once
+    static GrammarRegistry &get() {
+        static GrammarRegistry registry = []() {
+            GrammarRegistry gr;
+            gr.load_config("configs/config.json");
+            if (!gr.has_grammars_config) {
+                gr.add_fallback_grammar();
+            }
+            return gr;
+        }();
+        return registry;
+    }
+
+  private:
+    // without any grammars configured, C++ still works the way it always
+    // has (ctrl+P asks for it by name)
+    void add_fallback_grammar() {
+        add_grammar("C++", "tree_sitter_langs/cpp/cpp.so", "tree_sitter_cpp",
+                    "tree_sitter_langs/cpp/highlights.scm",
+                    "tree_sitter_langs/cpp/locals.scm",
+                    {"cpp", "cc", "cxx", "hpp", "hh", "hxx", "h"}, {},
+                    {"cpp", "c++"});
+    }
+
+    template <typename Entry, typename T>
+    static Entry *
+    detect_in(std::vector<std::unique_ptr<Entry>> const &entries,
+              std::optional<std::string_view> maybe_filename,
+              T const &buffer) {
+        size_t num_lines = buffer.num_lines();
+        for (size_t idx = 0; idx < num_lines; ++idx) {
+            if (idx == modeline_search_lines &&
+                num_lines > 2 * modeline_search_lines) {
+                idx = num_lines - modeline_search_lines;
+            }
+            if (auto maybe_mode = get_modeline_mode(buffer.at(idx))) {
+                if (Entry *entry =
+                        find_by(entries, &Entry::modelines, *maybe_mode)) {
+                    return entry;
+                }
+            }
+        }
+
+        if (num_lines > 0) {
+            if (auto maybe_interpreter =
+                    get_shebang_interpreter(buffer.at(0))) {
+                if (Entry *entry = find_by(entries, &Entry::shebangs,
+                                           *maybe_interpreter)) {
+                    return entry;
+                }
+            }
+        }
+
+        if (maybe_filename) {
+            std::string_view filename = *maybe_filename;
+            size_t slash_pos = filename.rfind('/');
+            if (slash_pos != std::string_view::npos) {
+                filename = filename.substr(slash_pos + 1);
+            }
+            if (Entry *entry = find_by(entries, &Entry::filenames, filename)) {
+                return entry;
+            }
+            size_t dot_pos = filename.rfind('.');
+            if (dot_pos != std::string_view::npos && dot_pos != 0) {
+                return find_by(entries, &Entry::extensions,
+                               filename.substr(dot_pos + 1));
+            }
+        }
+        return nullptr;
+    }
+
+    template <typename Entry>
+    static Entry *find_by(std::vector<std::unique_ptr<Entry>> const &entries,
+                          std::vector<std::string> Entry::*keys,
+                          std::string_view key) {
+        for (auto const &entry : entries) {
+            for (std::string const &candidate : (*entry).*keys) {
+                if (candidate == key) {
+                    return entry.get();
+                }
+            }
+        }
+        return nullptr;
+    }
+
+    // "states": {"root": [{"match": ..., "style": ..., "next": ...}, ...]}
+    static std::vector<LineSyntax::State>
+    get_line_states(JsonValue const &states_config) {
+        std::vector<LineSyntax::State> to_return;
+        for (size_t idx = 0; idx < states_config.object_keys.size(); ++idx) {
+            JsonValue const &rules_config = states_config.object_values[idx];
+            LineSyntax::State state{.name = states_config.object_keys[idx],
+                                    .rules = {}};
+            if (rules_config.is_array()) {
+                for (JsonValue const &rule_config : rules_config.array) {
+                    auto maybe_match = rule_config.get_string("match");
+                    if (!maybe_match) {
+                        continue;
+                    }
+                    state.rules.push_back(LineSyntax::Rule{
+                        .pattern = std::string(*maybe_match),
+                        .style_name = std::string(
+                            rule_config.get_string("style").value_or("")),
+                        .next_state = std::string(
+                            rule_config.get_string("next").value_or(""))});
+                }
+            }
+            to_return.push_back(std::move(state));
+        }
+        return to_return;
+    }
+
+    static std::vector<std::string> get_string_list(JsonValue const *value) {
+        std::vector<std::string> to_return;
+        if (!value || !value->is_array()) {
+            return to_return;
+        }
+        for (JsonValue const &elem : value->array) {
+            if (elem.is_string()) {
+                to_return.push_back(elem.str);
+            }
+        }
+        return to_return;
+    }
+
+    static bool is_mode_char(char c) {
+        return isalnum((unsigned char)c) || c == '+' || c == '-' || c == '_';
+    }
+
+    // "#!/usr/bin/python3" and "#!/usr/bin/env python3" both give "python3"
+    static std::optional<std::string_view>
+    get_shebang_interpreter(std::string_view line) {
+        if (!line.starts_with("#!")) {
+            return std::nullopt;
+        }
+        line.remove_prefix(2);
+
+        auto next_word = [&]() {
+            size_t start = line.find_first_not_of(" \t");
+            if (start == std::string_view::npos) {
+                line = {};
+                return std::string_view{};
+            }
+            size_t end = line.find_first_of(" \t", start);
+            end = (end == std::string_view::npos) ? line.size() : end;
+            std::string_view word = line.substr(start, end - start);
+            line.remove_prefix(end);
+            size_t slash_pos = word.rfind('/');
+            return (slash_pos == std::string_view::npos)
+                       ? word
+                       : word.substr(slash_pos + 1);
+        };
+
+        std::string_view interpreter = next_word();
+        if (interpreter == "env") {
+            interpreter = next_word();
+            // skip over flags like "env -S"
+            while (interpreter.starts_with("-")) {
+                interpreter = next_word();
+            }
+        }
+        if (interpreter.empty()) {
+            return std::nullopt;
+        }
+        return interpreter;
+    }
+
+    // vim's "ft=cpp" / "filetype=cpp" and emacs' "-*- mode: c++ -*-"
+    static std::optional<std::string_view>
+    get_modeline_mode(std::string_view line) {
+        auto mode_after = [&](std::string_view marker)
+            -> std::optional<std::string_view> {
+            size_t pos = line.find(marker);
+            if (pos == std::string_view::npos) {
+                return std::nullopt;
+            }
+            std::string_view rest = line.substr(pos + marker.size());
+            size_t start = rest.find_first_not_of(' ');
+            if (start == std::string_view::npos) {
+                return std::nullopt;
+            }
+            size_t end = start;
+            while (end < rest.size() && is_mode_char(rest[end])) {
+                ++end;
+            }
+            if (end == start) {
+                return std::nullopt;
+            }
+            return rest.substr(start, end - start);
+        };
+
+        if (line.find("-*-") != std::string_view::npos) {
+            if (auto maybe_mode = mode_after("mode:")) {
+                return maybe_mode;
+            }
+        }
+        if (line.find("vim:") != std::string_view::npos ||
+            line.find("vi:") != std::string_view::npos) {
+            if (auto maybe_mode = mode_after("filetype=")) {
+                return maybe_mode;
+            }
+            return mode_after("ft=");
+        }
+        return std::nullopt;
+    }
+};
@@ -0,0 +1,118 @@
+#pragma once
+
+#include <assert.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <algorithm>
+#include <utility>
+#include <vector>
+
+#include <tree_sitter/api.h>
+
+// a resolved highlight on a single line: [start_col, end_col) gets styled
+// with the Highlighter's style at style_id
+struct HighlightSpan {
+    uint32_t start_col;
+    uint32_t end_col;
+    uint16_t style_id;
+};
+
+// Per-line cache of highlight spans, indexed by row. Rows only get dropped
+// when an edit touches them, or when a new tree says they changed
+// (ts_tree_get_changed_ranges); everything else survives across frames, so
+// scrolling and cursor movement never have to run the query again.
+class HighlightCache {
+    struct Line {
+        bool valid = false;
+        // filled from a tree that hasn't caught up with the buffer yet; we
+        // need to redo these once a fresh tree comes back
+        bool provisional = false;
+        std::vector<HighlightSpan> spans;
+    };
+
+    std::vector<Line> lines;
+
+  public:
+    HighlightCache() {
+    }
+
+    size_t num_lines() const {
+        return lines.size();
+    }
+
+    void reset(size_t num_lines) {
+        lines.clear();
+        lines.resize(num_lines);
+    }
+
+    bool is_valid(size_t row) const {
+        return row < lines.size() && lines[row].valid;
+    }
+
+    std::vector<HighlightSpan> const &spans_at(size_t row) const {
+        assert(is_valid(row));
+        return lines[row].spans;
+    }
+
+    void set_spans(size_t row, std::vector<HighlightSpan> spans,
+                   bool provisional) {
+        assert(row < lines.size());
+        lines[row] = Line{
+            .valid = true, .provisional = provisional, .spans = std::move(spans)};
+    }
+
+    // rows [start, old_end] of the edit get replaced by [start, new_end];
+    // shift everything below accordingly and drop the rows that were touched
+    void apply_edit(TSInputEdit const &edit) {
+        size_t start_row = edit.start_point.row;
+        if (start_row >= lines.size()) {
+            return;
+        }
+
+        size_t old_end_row =
+            std::min((size_t)edit.old_end_point.row, lines.size() - 1);
+        size_t new_end_row = edit.new_end_point.row;
+
+        lines.erase(lines.begin() + (ssize_t)start_row + 1,
+                    lines.begin() + (ssize_t)old_end_row + 1);
+        lines.insert(lines.begin() + (ssize_t)start_row + 1,
+                     new_end_row - start_row, Line{});
+        lines[start_row] = Line{};
+    }
+
+    // inclusive on both ends
+    void invalidate_rows(size_t first_row, size_t last_row) {
+        last_row = std::min(last_row, lines.size() - 1);
+        for (size_t row = first_row; row <= last_row && row < lines.size();
+             ++row) {
+            lines[row].valid = false;
+        }
+    }
+
+    void invalidate_ranges(TSRange const *ranges, uint32_t num_ranges) {
+        for (uint32_t idx = 0; idx < num_ranges; ++idx) {
+            invalidate_rows(ranges[idx].start_point.row,
+                            ranges[idx].end_point.row);
+        }
+    }
+
+    void invalidate_provisional() {
+        for (Line &line : lines) {
+            if (line.provisional) {
+                line.valid = false;
+                line.provisional = false;
+            }
+        }
+    }
+
+    // returns the end (exclusive) of the run of invalid rows starting at
+    // first_row, capped at last_row + 1
+    size_t invalid_run_end(size_t first_row, size_t last_row) const {
+        size_t row = first_row;
+        while (row <= last_row && row < lines.size() && !lines[row].valid) {
+            ++row;
+        }
+        return row;
+    }
+};
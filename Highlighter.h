@@ -0,0 +1,251 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#include <limits>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include <notcurses/notcurses.h>
+#include <tree_sitter/api.h>
+
+#include "File.h"
+#include "Json.h"
+
+// simple mapper from a "syntax type index" into a an RGB that we style the
+// text with. Capture names get resolved into style ids once per compiled
+// query (see resolve_capture_styles), so rendering only ever indexes into
+// styles.
+struct Highlighter {
+    struct Colour {
+        uint8_t r;
+        uint8_t g;
+        uint8_t b;
+
+        Colour()
+            : r(0),
+              g(0),
+              b(0) {
+        }
+
+        Colour(uint8_t r_, uint8_t g_, uint8_t b_)
+            : r(r_),
+              g(g_),
+              b(b_) {
+        }
+    };
+
+    enum class Style { UNDERLINE, BOLD, ITALICIZE };
+
+    struct Highlight {
+        std::optional<Colour> fg_colour;
+        std::optional<Colour> bg_colour;
+        uint16_t nc_style;
+
+        Highlight()
+            : fg_colour(std::nullopt),
+              bg_colour(std::nullopt),
+              nc_style(NCSTYLE_NONE) {
+        }
+
+        Highlight(Colour fgc)
+            : fg_colour(fgc),
+              bg_colour(std::nullopt),
+              nc_style(NCSTYLE_NONE) {
+        }
+
+        Highlight(Colour fgc, Colour bgc, uint16_t ncs)
+            : fg_colour(fgc),
+              bg_colour(bgc),
+              nc_style(ncs) {
+        }
+
+        bool has_fg_colour() const {
+            return fg_colour.has_value();
+        }
+
+        bool has_bg_colour() const {
+            return bg_colour.has_value();
+        }
+
+        bool has_style() const {
+            return nc_style != NCSTYLE_NONE;
+        }
+    };
+
+    // for captures that nothing in the theme matches
+    static constexpr uint16_t NO_STYLE = std::numeric_limits<uint16_t>::max();
+
+    std::vector<Highlight> styles;
+    std::unordered_map<std::string, uint16_t> name_to_style;
+
+    Highlight const &operator[](uint16_t style_id) const {
+        return styles[style_id];
+    }
+
+    void set_style(std::string_view name, Highlight highlight) {
+        if (auto it = name_to_style.find(std::string(name));
+            it != name_to_style.end()) {
+            styles[it->second] = highlight;
+            return;
+        }
+        name_to_style[std::string(name)] = (uint16_t)styles.size();
+        styles.push_back(highlight);
+    }
+
+    // longest-prefix fallback, e.g. "keyword.control.return" tries itself,
+    // then "keyword.control", then "keyword"
+    uint16_t style_for_name(std::string_view capture_name) const {
+        while (true) {
+            if (auto it = name_to_style.find(std::string(capture_name));
+                it != name_to_style.end()) {
+                return it->second;
+            }
+
+            size_t dot_pos = capture_name.rfind('.');
+            if (dot_pos == std::string_view::npos) {
+                return NO_STYLE;
+            }
+            capture_name = capture_name.substr(0, dot_pos);
+        }
+    }
+
+    // maps every capture id in the query to a style id
+    std::vector<uint16_t> resolve_capture_styles(TSQuery const *query) const {
+        std::vector<uint16_t> to_return(ts_query_capture_count(query));
+        for (uint32_t capture_id = 0; capture_id < to_return.size();
+             ++capture_id) {
+            uint32_t size;
+            char const *name =
+                ts_query_capture_name_for_id(query, capture_id, &size);
+            to_return[capture_id] = style_for_name({name, size});
+        }
+        return to_return;
+    }
+
+    // reads the "highlight_styles" section of the config; entries there
+    // override any style already set. Returns false if the file couldn't be
+    // used.
+    bool load_config(std::string_view filename) {
+        File config_file{filename};
+        if (config_file.get_mode() == File::Mode::SCRATCH ||
+            config_file.get_mode() == File::Mode::UNREADABLE) {
+            return false;
+        }
+
+        std::optional<std::string> contents = config_file.get_file_contents();
+        if (!contents) {
+            return false;
+        }
+
+        std::optional<JsonValue> config = JsonParser::parse(*contents);
+        if (!config) {
+            return false;
+        }
+
+        JsonValue const *highlight_styles = config->get("highlight_styles");
+        if (!highlight_styles || !highlight_styles->is_object()) {
+            return false;
+        }
+
+        for (size_t idx = 0; idx < highlight_styles->object_keys.size();
+             ++idx) {
+            JsonValue const &entry = highlight_styles->object_values[idx];
+            Highlight highlight;
+            highlight.fg_colour = parse_colour(entry.get_string("fg_rgb"));
+            highlight.bg_colour = parse_colour(entry.get_string("bg_rgb"));
+            highlight.nc_style = parse_style(entry.get("style"));
+            set_style(highlight_styles->object_keys[idx], highlight);
+        }
+        return true;
+    }
+
+    // everyone shares the one theme
+    static Highlighter &get() {
+        static Highlighter highlighter = []() {
+            Highlighter hl;
+            if (!hl.load_config("configs/config.json")) {
+                hl.set_fallback_styles();
+            }
+            return hl;
+        }();
+        return highlighter;
+    }
+
+    // the theme lives in the config; see get()
+    Highlighter() {
+    }
+
+    // just enough to tell code apart when the config has no usable
+    // "highlight_styles"
+    void set_fallback_styles() {
+        set_style("comment", Colour{0x79, 0x79, 0x79});
+        set_style("string", Colour{0xae, 0x66, 0x41});
+        set_style("keyword", Colour{0xc5, 0x86, 0xc0});
+        set_style("type", Colour{0x4e, 0xc9, 0xb0});
+        set_style("function", Colour{0xdc, 0xdc, 0xaa});
+        Highlight error_highlight;
+        error_highlight.nc_style = NCSTYLE_UNDERLINE;
+        set_style("diagnostic.error", error_highlight);
+    }
+
+  private:
+    // "rrggbb", or null for no colour
+    static std::optional<Colour>
+    parse_colour(std::optional<std::string_view> maybe_hex) {
+        if (!maybe_hex || maybe_hex->size() != 6) {
+            return std::nullopt;
+        }
+
+        std::string hex{*maybe_hex};
+        char *end;
+        unsigned long rgb = strtoul(hex.c_str(), &end, 16);
+        if (end != hex.c_str() + hex.size()) {
+            return std::nullopt;
+        }
+        return Colour{(uint8_t)(rgb >> 16), (uint8_t)(rgb >> 8), (uint8_t)rgb};
+    }
+
+    // either null, a single style name, or a list of them
+    static uint16_t parse_style(JsonValue const *style) {
+        auto style_bit = [](std::string_view name) -> uint16_t {
+            if (name == "bold") {
+                return NCSTYLE_BOLD;
+            }
+            if (name == "italic") {
+                return NCSTYLE_ITALIC;
+            }
+            if (name == "underline") {
+                return NCSTYLE_UNDERLINE;
+            }
+            if (name == "undercurl") {
+                return NCSTYLE_UNDERCURL;
+            }
+            if (name == "struck") {
+                return NCSTYLE_STRUCK;
+            }
+            return NCSTYLE_NONE;
+        };
+
+        if (!style) {
+            return NCSTYLE_NONE;
+        }
+        if (style->is_string()) {
+            return style_bit(style->str);
+        }
+
+        uint16_t to_return = NCSTYLE_NONE;
+        if (style->is_array()) {
+            for (JsonValue const &elem : style->array) {
+                if (elem.is_string()) {
+                    to_return = (uint16_t)(to_return | style_bit(elem.str));
+                }
+            }
+        }
+        return to_return;
+    }
+};
@@ -0,0 +1,285 @@
+#pragma once
+
+#include <assert.h>
+#include <stddef.h>
+#include <stdlib.h>
+
+#include <optional>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+// Just enough JSON to read our config files with. Objects keep their keys
+// in file order, and lookups are linear (configs are small).
+struct JsonValue {
+    enum class Type { NUL, BOOL, NUMBER, STRING, ARRAY, OBJECT };
+    using enum Type;
+
+    Type type;
+    bool boolean;
+    double number;
+    std::string str;
+    std::vector<JsonValue> array;
+    std::vector<std::string> object_keys;
+    std::vector<JsonValue> object_values;
+
+    JsonValue()
+        : type(NUL),
+          boolean(false),
+          number(0) {
+    }
+
+    bool is_null() const {
+        return type == NUL;
+    }
+
+    bool is_bool() const {
+        return type == BOOL;
+    }
+
+    bool is_number() const {
+        return type == NUMBER;
+    }
+
+    bool is_string() const {
+        return type == STRING;
+    }
+
+    bool is_array() const {
+        return type == ARRAY;
+    }
+
+    bool is_object() const {
+        return type == OBJECT;
+    }
+
+    // returns nullptr if this isn't an object or the key is missing
+    JsonValue const *get(std::string_view key) const {
+        for (size_t idx = 0; idx < object_keys.size(); ++idx) {
+            if (object_keys[idx] == key) {
+                return &object_values[idx];
+            }
+        }
+        return nullptr;
+    }
+
+    // convenience for optional string fields
+    std::optional<std::string_view> get_string(std::string_view key) const {
+        JsonValue const *value = get(key);
+        if (!value || !value->is_string()) {
+            return std::nullopt;
+        }
+        return value->str;
+    }
+};
+
+class JsonParser {
+    std::string_view text;
+    size_t pos;
+
+  public:
+    // returns std::nullopt on any syntax error
+    static std::optional<JsonValue> parse(std::string_view text) {
+        JsonParser parser{text};
+        std::optional<JsonValue> to_return = parser.parse_value();
+        parser.skip_whitespace();
+        if (parser.pos != text.size()) {
+            return std::nullopt;
+        }
+        return to_return;
+    }
+
+  private:
+    JsonParser(std::string_view t)
+        : text(t),
+          pos(0) {
+    }
+
+    void skip_whitespace() {
+        while (pos < text.size() &&
+               (text[pos] == ' ' || text[pos] == '\t' || text[pos] == '\n' ||
+                text[pos] == '\r')) {
+            ++pos;
+        }
+    }
+
+    bool consume(char c) {
+        skip_whitespace();
+        if (pos < text.size() && text[pos] == c) {
+            ++pos;
+            return true;
+        }
+        return false;
+    }
+
+    bool consume_literal(std::string_view literal) {
+        if (text.substr(pos).starts_with(literal)) {
+            pos += literal.size();
+            return true;
+        }
+        return false;
+    }
+
+    std::optional<JsonValue> parse_value() {
+        skip_whitespace();
+        if (pos >= text.size()) {
+            return std::nullopt;
+        }
+
+        JsonValue value;
+        switch (text[pos]) {
+        case '{':
+            return parse_object();
+        case '[':
+            return parse_array();
+        case '"': {
+            std::optional<std::string> maybe_str = parse_string();
+            if (!maybe_str) {
+                return std::nullopt;
+            }
+            value.type = JsonValue::STRING;
+            value.str = std::move(*maybe_str);
+            return value;
+        }
+        case 't':
+        case 'f':
+            value.type = JsonValue::BOOL;
+            value.boolean = text[pos] == 't';
+            if (!consume_literal(value.boolean ? "true" : "false")) {
+                return std::nullopt;
+            }
+            return value;
+        case 'n':
+            if (!consume_literal("null")) {
+                return std::nullopt;
+            }
+            return value;
+        default:
+            return parse_number();
+        }
+    }
+
+    std::optional<JsonValue> parse_number() {
+        // strtod wants a null terminated string
+        size_t end = pos;
+        while (end < text.size() &&
+               std::string_view{"+-0123456789.eE"}.find(text[end]) !=
+                   std::string_view::npos) {
+            ++end;
+        }
+        if (end == pos) {
+            return std::nullopt;
+        }
+
+        std::string num_str{text.substr(pos, end - pos)};
+        char *num_end;
+        JsonValue value;
+        value.type = JsonValue::NUMBER;
+        value.number = strtod(num_str.c_str(), &num_end);
+        if (num_end != num_str.c_str() + num_str.size()) {
+            return std::nullopt;
+        }
+        pos = end;
+        return value;
+    }
+
+    std::optional<std::string> parse_string() {
+        if (!consume('"')) {
+            return std::nullopt;
+        }
+
+        std::string to_return;
+        while (pos < text.size() && text[pos] != '"') {
+            if (text[pos] != '\\') {
+                to_return.push_back(text[pos++]);
+                continue;
+            }
+
+            if (++pos >= text.size()) {
+                return std::nullopt;
+            }
+            switch (text[pos++]) {
+            case 'n':
+                to_return.push_back('\n');
+                break;
+            case 't':
+                to_return.push_back('\t');
+                break;
+            case 'r':
+                to_return.push_back('\r');
+                break;
+            case 'b':
+                to_return.push_back('\b');
+                break;
+            case 'f':
+                to_return.push_back('\f');
+                break;
+            case 'u':
+                // we don't expect these in configs; keep them verbatim
+                to_return += "\\u";
+                break;
+            default:
+                // covers \" \\ and \/
+                to_return.push_back(text[pos - 1]);
+                break;
+            }
+        }
+
+        if (pos >= text.size()) {
+            return std::nullopt;
+        }
+        ++pos; // closing quote
+        return to_return;
+    }
+
+    std::optional<JsonValue> parse_array() {
+        JsonValue value;
+        value.type = JsonValue::ARRAY;
+        consume('[');
+        if (consume(']')) {
+            return value;
+        }
+
+        do {
+            std::optional<JsonValue> element = parse_value();
+            if (!element) {
+                return std::nullopt;
+            }
+            value.array.push_back(std::move(*element));
+        } while (consume(','));
+
+        if (!consume(']')) {
+            return std::nullopt;
+        }
+        return value;
+    }
+
+    std::optional<JsonValue> parse_object() {
+        JsonValue value;
+        value.type = JsonValue::OBJECT;
+        consume('{');
+        if (consume('}')) {
+            return value;
+        }
+
+        do {
+            skip_whitespace();
+            std::optional<std::string> key = parse_string();
+            if (!key || !consume(':')) {
+                return std::nullopt;
+            }
+            std::optional<JsonValue> element = parse_value();
+            if (!element) {
+                return std::nullopt;
+            }
+            value.object_keys.push_back(std::move(*key));
+            value.object_values.push_back(std::move(*element));
+        } while (consume(','));
+
+        if (!consume('}')) {
+            return std::nullopt;
+        }
+        return value;
+    }
+};
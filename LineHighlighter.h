@@ -0,0 +1,262 @@
+#pragma once
+
+#include <assert.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <algorithm>
+#include <limits>
+#include <optional>
+#include <regex>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include "HighlightCache.h"
+#include "Highlighter.h"
+
+// A regex-based description of a language, for files without a tree-sitter
+// grammar. Much like a TextMate grammar: every state has a list of rules,
+// and a rule can switch to another state once it matches (which is how
+// things like block comments carry over onto the next line). The rules
+// come from the config, and only get compiled the first time a buffer uses
+// them.
+struct LineSyntax {
+    struct Rule {
+        std::string pattern;
+        std::string style_name;
+        std::string next_state; // empty to stay in the current state
+    };
+
+    struct State {
+        std::string name;
+        std::vector<Rule> rules;
+    };
+
+    struct CompiledRule {
+        std::regex regex;
+        uint16_t style_id;
+        uint16_t next_state;
+    };
+
+    std::string name; // shown in the status bar
+    std::vector<std::string> extensions; // without the leading '.'
+    std::vector<std::string> filenames;  // whole names, like "Makefile"
+    std::vector<std::string> shebangs;   // interpreter names
+    std::vector<std::string> modelines;  // vim ft= / emacs mode: names
+    std::vector<State> states;           // every file starts in the first
+
+    // filled in by load(); indexed like states
+    bool load_attempted = false;
+    std::vector<std::vector<CompiledRule>> compiled_states;
+
+    bool is_loaded() const {
+        return !compiled_states.empty();
+    }
+
+    // compiles the rules, once; rules that don't compile get dropped.
+    // Returns false if there's nothing to highlight with.
+    bool load() {
+        if (load_attempted) {
+            return is_loaded();
+        }
+        load_attempted = true;
+
+        auto find_state = [&](std::string_view state_name,
+                              uint16_t fallback) -> uint16_t {
+            for (size_t idx = 0; idx < states.size(); ++idx) {
+                if (states[idx].name == state_name) {
+                    return (uint16_t)idx;
+                }
+            }
+            return fallback;
+        };
+
+        Highlighter const &highlighter = Highlighter::get();
+        std::vector<std::vector<CompiledRule>> to_set(states.size());
+        for (size_t state_idx = 0; state_idx < states.size(); ++state_idx) {
+            for (Rule const &rule : states[state_idx].rules) {
+                std::optional<std::regex> maybe_regex =
+                    compile_regex(rule.pattern);
+                if (!maybe_regex) {
+                    continue;
+                }
+                to_set[state_idx].push_back(CompiledRule{
+                    .regex = std::move(*maybe_regex),
+                    .style_id = highlighter.style_for_name(rule.style_name),
+                    .next_state =
+                        find_state(rule.next_state, (uint16_t)state_idx)});
+            }
+        }
+        compiled_states = std::move(to_set);
+        return is_loaded();
+    }
+
+  private:
+    static std::optional<std::regex> compile_regex(std::string const &pattern) {
+        // std::regex only reports bad patterns by throwing
+        try {
+            return std::regex{pattern, std::regex::ECMAScript |
+                                           std::regex::optimize};
+        } catch (std::regex_error const &) {
+            return std::nullopt;
+        }
+    }
+};
+
+// Highlights a buffer with a LineSyntax. Each line remembers the state it
+// started and ended in, so after an edit we only retokenize lines until the
+// state coming out of one matches what the next line started in before.
+// Nothing past the last row on screen gets looked at, so this is cheap
+// enough to run synchronously every frame.
+class LineHighlighter {
+    static constexpr uint16_t unknown_state =
+        std::numeric_limits<uint16_t>::max();
+    // the rest of a line past this is left alone, minified files and the
+    // like would take forever otherwise
+    static constexpr size_t max_line_length = 4096;
+
+    struct Line {
+        // the line changed since it was last tokenized
+        bool dirty = true;
+        uint16_t start_state = unknown_state;
+        uint16_t end_state = unknown_state;
+        std::vector<HighlightSpan> spans;
+    };
+
+    LineSyntax const *syntax_ptr;
+    // filled lazily by the renderer, hence mutable
+    mutable std::vector<Line> lines;
+    // rows [0, settled_rows) have up to date spans and end states
+    mutable size_t settled_rows;
+
+  public:
+    // the syntax must already be loaded; see LineSyntax::load()
+    explicit LineHighlighter(LineSyntax const *sp)
+        : syntax_ptr(sp),
+          settled_rows(0) {
+        assert(sp && sp->is_loaded());
+    }
+
+    std::string_view get_syntax_name() const {
+        return syntax_ptr->name;
+    }
+
+    void reset(size_t num_lines) {
+        clear_lines(num_lines);
+    }
+
+    // rows [start, old_end] got replaced by [start, new_end]
+    void apply_edit(size_t start_row, size_t old_end_row, size_t new_end_row) {
+        if (start_row >= lines.size()) {
+            return;
+        }
+        old_end_row = std::min(old_end_row, lines.size() - 1);
+
+        lines.erase(lines.begin() + (ssize_t)start_row + 1,
+                    lines.begin() + (ssize_t)old_end_row + 1);
+        lines.insert(lines.begin() + (ssize_t)start_row + 1,
+                     new_end_row - start_row, Line{});
+        lines[start_row].dirty = true;
+        settled_rows = std::min(settled_rows, start_row);
+    }
+
+    // makes sure rows [first_row, last_row] have their spans; T needs at()
+    // and num_lines()
+    template <typename T>
+    void prepare_highlights([[maybe_unused]] size_t first_row,
+                            size_t last_row, T const &buffer) const {
+        if (lines.size() != buffer.num_lines()) {
+            // something edited the buffer behind our back
+            clear_lines(buffer.num_lines());
+        }
+        if (lines.empty()) {
+            return;
+        }
+        last_row = std::min(last_row, lines.size() - 1);
+
+        // every row needs the state the one above it ended in, so this
+        // walks down from wherever the last edit was. Rows that didn't
+        // change and start in the same state as before are just skipped.
+        while (settled_rows <= last_row) {
+            size_t row = settled_rows;
+            uint16_t start_state = (row == 0) ? 0 : lines[row - 1].end_state;
+            Line &line = lines[row];
+            if (line.dirty || line.start_state != start_state) {
+                tokenize(line, start_state, buffer.at(row));
+            }
+            ++settled_rows;
+        }
+    }
+
+    bool has_line_highlights(size_t row) const {
+        return row < settled_rows;
+    }
+
+    std::vector<HighlightSpan> const &get_line_highlights(size_t row) const {
+        assert(has_line_highlights(row));
+        return lines[row].spans;
+    }
+
+  private:
+    void clear_lines(size_t num_lines) const {
+        lines.clear();
+        lines.resize(num_lines);
+        settled_rows = 0;
+    }
+
+    // at every position, the rule in the current state that matches the
+    // earliest wins (ties go to whichever is listed first)
+    void tokenize(Line &line, uint16_t start_state,
+                  std::string_view text) const {
+        text = text.substr(0, max_line_length);
+        line.dirty = false;
+        line.start_state = start_state;
+        line.spans.clear();
+
+        uint16_t state = start_state;
+        size_t pos = 0;
+        while (pos <= text.size()) {
+            std::cmatch best_match;
+            LineSyntax::CompiledRule const *best_rule = nullptr;
+            // so that ^ and \b still see what comes before pos
+            auto flags = (pos == 0) ? std::regex_constants::match_default
+                                    : std::regex_constants::match_prev_avail;
+
+            for (LineSyntax::CompiledRule const &rule :
+                 syntax_ptr->compiled_states[state]) {
+                std::cmatch match;
+                if (!std::regex_search(text.data() + pos,
+                                       text.data() + text.size(), match,
+                                       rule.regex, flags)) {
+                    continue;
+                }
+                if (!best_rule || match.position(0) < best_match.position(0)) {
+                    best_match = std::move(match);
+                    best_rule = &rule;
+                    if (best_match.position(0) == 0) {
+                        break;
+                    }
+                }
+            }
+
+            if (!best_rule) {
+                break;
+            }
+
+            size_t match_start = pos + (size_t)best_match.position(0);
+            size_t match_end = match_start + (size_t)best_match.length(0);
+            if (best_rule->style_id != Highlighter::NO_STYLE &&
+                match_end > match_start) {
+                line.spans.push_back({.start_col = (uint32_t)match_start,
+                                      .end_col = (uint32_t)match_end,
+                                      .style_id = best_rule->style_id});
+            }
+            state = best_rule->next_state;
+            // empty matches (lookaheads, ^) still have to make progress
+            pos = (match_end > pos) ? match_end : pos + 1;
+        }
+        line.end_state = state;
+    }
+};
@@ -0,0 +1,449 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <algorithm>
+#include <limits>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include <tree_sitter/api.h>
+
+#include "DirtyRows.h"
+#include "HighlightCache.h"
+#include "Highlighter.h"
+#include "QueryPredicates.h"
+
+// What each capture of a locals.scm query is for. Both the "local.scope"
+// style names and the older "scope" ones are understood.
+struct LocalsCaptures {
+    enum class Role : uint8_t { NONE, SCOPE, DEFINITION, REFERENCE };
+
+    std::vector<Role> roles;
+    // for definitions: the style that references to them get. A
+    // "definition.parameter" styles its references as "variable.parameter",
+    // "definition.function" as "function", and a bare "definition" (or
+    // "definition.var") as "variable".
+    std::vector<uint16_t> styles;
+
+    LocalsCaptures() {
+    }
+
+    explicit LocalsCaptures(TSQuery const *query) {
+        uint32_t num_captures = ts_query_capture_count(query);
+        roles.resize(num_captures, Role::NONE);
+        styles.resize(num_captures, Highlighter::NO_STYLE);
+
+        for (uint32_t capture_id = 0; capture_id < num_captures;
+             ++capture_id) {
+            uint32_t size;
+            std::string_view name{
+                ts_query_capture_name_for_id(query, capture_id, &size), size};
+            if (name.starts_with("local.")) {
+                name.remove_prefix(6);
+            }
+
+            if (name == "scope") {
+                roles[capture_id] = Role::SCOPE;
+            } else if (name == "reference") {
+                roles[capture_id] = Role::REFERENCE;
+            } else if (name == "definition" ||
+                       name.starts_with("definition.")) {
+                roles[capture_id] = Role::DEFINITION;
+                name.remove_prefix(std::min(name.size(), (size_t)11));
+                styles[capture_id] = style_for_kind(name);
+            }
+        }
+    }
+
+  private:
+    static uint16_t style_for_kind(std::string_view kind) {
+        Highlighter const &highlighter = Highlighter::get();
+        if (kind.empty() || kind == "var") {
+            return highlighter.style_for_name("variable");
+        }
+        if (kind == "function" || kind == "type" || kind == "namespace" ||
+            kind == "constant") {
+            return highlighter.style_for_name(kind);
+        }
+        // falls back to plain "variable" if the theme has nothing specific
+        return highlighter.style_for_name("variable." + std::string(kind));
+    }
+};
+
+// Resolves locals.scm references to their definitions, so they can be
+// highlighted like the definition. The tree gets split into units (local
+// scopes, and whatever small top level nodes sit between them); references
+// only resolve within their own unit. Edits and changed ranges just mark
+// rows dirty, and rebuild() only requeries the units touching dirty rows,
+// so a keystroke never rescans the whole file.
+class LocalsIndex {
+    // a top level node bigger than this that isn't a scope gets split up
+    // into its children, so something like a namespace wrapping the whole
+    // file doesn't turn into one giant unit
+    static constexpr size_t max_unit_rows = 200;
+
+    struct Reference {
+        size_t row; // relative to the unit's first row
+        uint32_t start_col;
+        uint32_t end_col;
+        uint16_t style_id;
+    };
+
+    // rows are inclusive on both ends
+    struct Unit {
+        size_t first_row;
+        size_t last_row;
+        std::vector<Reference> refs; // sorted by row
+    };
+
+    using RowSpan = DirtyRows::RowSpan;
+
+    std::vector<Unit> units; // sorted, and not overlapping
+    DirtyRows dirty_rows;
+
+  public:
+    LocalsIndex() {
+    }
+
+    // forgets everything; the next rebuild covers the whole tree
+    void reset() {
+        units.clear();
+        dirty_rows.mark_all();
+    }
+
+    void mark_dirty(size_t first_row, size_t last_row) {
+        dirty_rows.mark(first_row, last_row);
+    }
+
+    // rows [start, old_end] became [start, new_end]: shift what comes after,
+    // and drop references on the rows that were touched
+    void apply_edit(TSInputEdit const &edit) {
+        DirtyRows::RowEdit row_edit{edit};
+        size_t start_row = row_edit.start_row;
+        size_t old_end_row = row_edit.old_end_row;
+
+        for (Unit &unit : units) {
+            size_t old_first_row = unit.first_row;
+            if (unit.last_row < start_row) {
+                continue;
+            }
+            row_edit.shift_span(unit.first_row, unit.last_row);
+            if (old_first_row > old_end_row) {
+                // relative rows are unaffected
+                continue;
+            }
+
+            if (old_first_row > start_row) {
+                // the unit's first row moved; not worth fixing up
+                unit.refs.clear();
+                continue;
+            }
+            std::erase_if(unit.refs, [&](Reference const &ref) {
+                size_t row = old_first_row + ref.row;
+                return start_row <= row && row <= old_end_row;
+            });
+            for (Reference &ref : unit.refs) {
+                if (old_first_row + ref.row > old_end_row) {
+                    size_t row = row_edit.shift(old_first_row + ref.row);
+                    ref.row = row - unit.first_row;
+                }
+            }
+        }
+        dirty_rows.apply_edit(row_edit);
+    }
+
+    // Requeries every unit touching a dirty row against the (fresh) tree.
+    // Returns the rows whose references may have changed.
+    template <typename T>
+    std::vector<RowSpan> rebuild(TSTree const *tree, TSQuery const *query,
+                                 LocalsCaptures const &captures,
+                                 QueryPredicates const &predicates,
+                                 T const &buffer) {
+        std::vector<RowSpan> to_return;
+        if (dirty_rows.empty()) {
+            return to_return;
+        }
+
+        std::vector<RowSpan> spans = dirty_rows.take_merged();
+        TSNode root = ts_tree_root_node(tree);
+        TSQueryCursor *query_cursor = ts_query_cursor_new();
+
+        size_t dirty_idx = 0;
+        while (dirty_idx < spans.size()) {
+            auto [first_row, last_row] = spans[dirty_idx++];
+
+            // Grow the span until it lines up with unit boundaries both in
+            // the old index and in the new tree.
+            std::vector<TSNode> unit_nodes;
+            while (true) {
+                auto [old_begin, old_end] =
+                    get_units_within(first_row, last_row);
+                if (old_begin != old_end) {
+                    first_row = std::min(first_row, old_begin->first_row);
+                    last_row = std::max(last_row, std::prev(old_end)->last_row);
+                }
+
+                unit_nodes.clear();
+                collect_unit_nodes(root, first_row, last_row, query,
+                                   query_cursor, captures, unit_nodes);
+                size_t new_first_row = first_row;
+                size_t new_last_row = last_row;
+                if (!unit_nodes.empty()) {
+                    new_first_row = std::min(
+                        first_row,
+                        (size_t)ts_node_start_point(unit_nodes.front()).row);
+                    new_last_row = std::max(
+                        last_row,
+                        (size_t)ts_node_end_point(unit_nodes.back()).row);
+                }
+
+                // later dirty spans we've grown over come along too
+                while (dirty_idx < spans.size() &&
+                       spans[dirty_idx].first <= new_last_row) {
+                    new_last_row =
+                        std::max(new_last_row, spans[dirty_idx++].second);
+                }
+
+                if (new_first_row == first_row && new_last_row == last_row) {
+                    break;
+                }
+                first_row = new_first_row;
+                last_row = new_last_row;
+            }
+
+            auto [old_begin, old_end] = get_units_within(first_row, last_row);
+            auto insert_pos = units.erase(old_begin, old_end);
+            std::vector<Unit> new_units = build_units(
+                unit_nodes, query, query_cursor, captures, predicates, buffer);
+            units.insert(insert_pos, std::make_move_iterator(new_units.begin()),
+                         std::make_move_iterator(new_units.end()));
+            to_return.push_back({first_row, last_row});
+        }
+
+        ts_query_cursor_delete(query_cursor);
+        return to_return;
+    }
+
+    // appends the resolved references on rows [first_row, end_row) to
+    // row_spans, which is indexed from first_row
+    void add_reference_spans(
+        size_t first_row, size_t end_row,
+        std::vector<std::vector<HighlightSpan>> &row_spans) const {
+        auto unit_it = std::partition_point(
+            units.begin(), units.end(),
+            [&](Unit const &unit) { return unit.last_row < first_row; });
+
+        for (; unit_it != units.end() && unit_it->first_row < end_row;
+             ++unit_it) {
+            size_t rel_first_row =
+                (first_row > unit_it->first_row)
+                    ? first_row - unit_it->first_row
+                    : 0;
+            auto ref_it = std::partition_point(
+                unit_it->refs.begin(), unit_it->refs.end(),
+                [&](Reference const &ref) { return ref.row < rel_first_row; });
+
+            for (; ref_it != unit_it->refs.end(); ++ref_it) {
+                size_t row = unit_it->first_row + ref_it->row;
+                if (row >= end_row) {
+                    break;
+                }
+                row_spans[row - first_row].push_back(
+                    {.start_col = ref_it->start_col,
+                     .end_col = ref_it->end_col,
+                     .style_id = ref_it->style_id});
+            }
+        }
+    }
+
+  private:
+    // the range of units overlapping rows [first_row, last_row]
+    std::pair<std::vector<Unit>::iterator, std::vector<Unit>::iterator>
+    get_units_within(size_t first_row, size_t last_row) {
+        auto begin = std::partition_point(
+            units.begin(), units.end(),
+            [&](Unit const &unit) { return unit.last_row < first_row; });
+        auto end = std::partition_point(
+            begin, units.end(),
+            [&](Unit const &unit) { return unit.first_row <= last_row; });
+        return {begin, end};
+    }
+
+    static bool is_scope(TSNode node, TSQuery const *query,
+                         TSQueryCursor *query_cursor,
+                         LocalsCaptures const &captures) {
+        uint32_t start_byte = ts_node_start_byte(node);
+        ts_query_cursor_set_byte_range(query_cursor, start_byte,
+                                       start_byte + 1);
+        ts_query_cursor_exec(query_cursor, query, node);
+
+        TSQueryMatch match;
+        uint32_t capture_idx;
+        while (ts_query_cursor_next_capture(query_cursor, &match,
+                                            &capture_idx)) {
+            TSQueryCapture const &capture = match.captures[capture_idx];
+            if (captures.roles[capture.index] ==
+                    LocalsCaptures::Role::SCOPE &&
+                ts_node_eq(capture.node, node)) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // the unit nodes among node's descendants that overlap
+    // [first_row, last_row], in order
+    static void collect_unit_nodes(TSNode node, size_t first_row,
+                                   size_t last_row, TSQuery const *query,
+                                   TSQueryCursor *query_cursor,
+                                   LocalsCaptures const &captures,
+                                   std::vector<TSNode> &unit_nodes) {
+        DirtyRows::for_each_child_within(
+            node, first_row, last_row, [&](TSNode child) {
+                size_t num_rows = ts_node_end_point(child).row -
+                                  ts_node_start_point(child).row;
+                if (num_rows < max_unit_rows ||
+                    ts_node_child_count(child) == 0 ||
+                    is_scope(child, query, query_cursor, captures)) {
+                    unit_nodes.push_back(child);
+                } else {
+                    collect_unit_nodes(child, first_row, last_row, query,
+                                       query_cursor, captures, unit_nodes);
+                }
+            });
+    }
+
+    template <typename T>
+    static std::vector<Unit>
+    build_units(std::vector<TSNode> const &unit_nodes, TSQuery const *query,
+                TSQueryCursor *query_cursor, LocalsCaptures const &captures,
+                QueryPredicates const &predicates, T const &buffer) {
+        std::vector<Unit> to_return;
+        for (TSNode node : unit_nodes) {
+            size_t first_row = ts_node_start_point(node).row;
+            size_t last_row = ts_node_end_point(node).row;
+            // nodes sharing a row end up in the same unit, so that units
+            // never overlap
+            if (to_return.empty() || to_return.back().last_row < first_row) {
+                to_return.push_back(
+                    Unit{.first_row = first_row, .last_row = last_row});
+            }
+            Unit &unit = to_return.back();
+            unit.last_row = std::max(unit.last_row, last_row);
+            add_unit_references(unit, node, query, query_cursor, captures,
+                                predicates, buffer);
+        }
+        return to_return;
+    }
+
+    // walks the captures under node in order, keeping a stack of the
+    // scopes we're in along with the definitions seen in each
+    template <typename T>
+    static void add_unit_references(Unit &unit, TSNode node,
+                                    TSQuery const *query,
+                                    TSQueryCursor *query_cursor,
+                                    LocalsCaptures const &captures,
+                                    QueryPredicates const &predicates,
+                                    T const &buffer) {
+        struct Definition {
+            std::string_view name; // views into the buffer
+            uint16_t style_id;
+        };
+        struct Scope {
+            uint32_t end_byte;
+            std::vector<Definition> defs;
+        };
+
+        // identifiers never span lines, so the name is a view into one
+        auto get_name = [&](TSNode name_node) -> std::string_view {
+            TSPoint start_point = ts_node_start_point(name_node);
+            TSPoint end_point = ts_node_end_point(name_node);
+            if (start_point.row != end_point.row ||
+                start_point.row >= buffer.num_lines()) {
+                return {};
+            }
+            std::string_view line = buffer.at(start_point.row);
+            if (end_point.column > line.size()) {
+                return {};
+            }
+            return line.substr(start_point.column,
+                               end_point.column - start_point.column);
+        };
+
+        // the unit itself acts as the outermost scope
+        std::vector<Scope> scopes{
+            Scope{.end_byte = std::numeric_limits<uint32_t>::max()}};
+
+        ts_query_cursor_set_byte_range(query_cursor, ts_node_start_byte(node),
+                                       ts_node_end_byte(node));
+        ts_query_cursor_exec(query_cursor, query, node);
+
+        TSQueryMatch match;
+        uint32_t capture_idx;
+        while (ts_query_cursor_next_capture(query_cursor, &match,
+                                            &capture_idx)) {
+            if (!predicates.is_satisfied(match, buffer)) {
+                ts_query_cursor_remove_match(query_cursor, match.id);
+                continue;
+            }
+
+            TSQueryCapture const &capture = match.captures[capture_idx];
+            uint32_t start_byte = ts_node_start_byte(capture.node);
+            while (scopes.size() > 1 && scopes.back().end_byte <= start_byte) {
+                scopes.pop_back();
+            }
+
+            switch (captures.roles[capture.index]) {
+                using enum LocalsCaptures::Role;
+            case SCOPE:
+                scopes.push_back(
+                    Scope{.end_byte = ts_node_end_byte(capture.node)});
+                break;
+            case DEFINITION: {
+                std::string_view name = get_name(capture.node);
+                if (!name.empty()) {
+                    scopes.back().defs.push_back(
+                        {.name = name,
+                         .style_id = captures.styles[capture.index]});
+                }
+            } break;
+            case REFERENCE: {
+                std::string_view name = get_name(capture.node);
+                uint16_t style_id = find_definition_style(scopes, name);
+                if (name.empty() || style_id == Highlighter::NO_STYLE) {
+                    break;
+                }
+                TSPoint start_point = ts_node_start_point(capture.node);
+                TSPoint end_point = ts_node_end_point(capture.node);
+                unit.refs.push_back(
+                    {.row = start_point.row - unit.first_row,
+                     .start_col = start_point.column,
+                     .end_col = end_point.column,
+                     .style_id = style_id});
+            } break;
+            default:
+                break;
+            }
+        }
+    }
+
+    // innermost scope first, latest definition first, so shadowing works
+    template <typename Scopes>
+    static uint16_t find_definition_style(Scopes const &scopes,
+                                          std::string_view name) {
+        for (auto scope_it = scopes.rbegin(); scope_it != scopes.rend();
+             ++scope_it) {
+            for (auto def_it = scope_it->defs.rbegin();
+                 def_it != scope_it->defs.rend(); ++def_it) {
+                if (def_it->name == name) {
+                    return def_it->style_id;
+                }
+            }
+        }
+        return Highlighter::NO_STYLE;
+    }
+};
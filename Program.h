@@ -6,22 +6,30 @@
 #include <signal.h>
 
 #include <assert.h>
+#include <stdint.h>
 
 #include <array>
+#include <chrono>
 #include <functional>
 #include <iostream>
+#include <list>
 #include <memory>
 #include <optional>
 #include <queue>
 #include <string>
+#include <tuple>
 #include <utility>
 #include <vector>
 
 #include <notcurses/notcurses.h>
 #include <tree_sitter/api.h>
 
+#include "EditorConfig.h"
 #include "EventQueue.h"
 #include "File.h"
+#include "Folds.h"
+#include "GrammarRegistry.h"
+#include "LineHighlighter.h"
 #include "Program.h"
 #include "text_buffer.h"
 #include "util.h"
@@ -40,31 +48,61 @@ struct StateReturn {
     Transition transition_type;
     ProgramState *next_state_ptr;
 
+    // what the handler changed on screen, so the main loop knows what (if
+    // anything) needs drawing again. Handlers that don't say are assumed to
+    // have changed everything.
+    enum Dirty : uint8_t {
+        CLEAN = 0,
+        // the buffer, its folds or its highlights, which every pane shows
+        TEXT = 1 << 0,
+        // the active pane's cursor, selection or scroll position
+        CURSOR = 1 << 1,
+        STATUS = 1 << 2,
+        // the prompt line's text or cursor
+        PROMPT = 1 << 3,
+        ALL = TEXT | CURSOR | STATUS | PROMPT,
+    };
+    uint8_t dirty;
+
     using enum Transition;
 
     StateReturn()
         : event_handled(true),
           transition_type(REMAIN),
-          next_state_ptr(nullptr) {
+          next_state_ptr(nullptr),
+          dirty(ALL) {
     }
 
     StateReturn(Transition tt)
-        : transition_type(tt) {
+        : transition_type(tt),
+          dirty(ALL) {
         assert(tt != ENTER);
     }
 
     StateReturn(ProgramState *ns)
         : transition_type(ENTER),
-          next_state_ptr(ns) {
+          next_state_ptr(ns),
+          dirty(ALL) {
     }
 
+    // an event that wasn't handled didn't change anything
     StateReturn(bool eh)
-        : event_handled(eh) {
+        : event_handled(eh),
+          transition_type(REMAIN),
+          next_state_ptr(nullptr),
+          dirty(eh ? ALL : CLEAN) {
+    }
+
+    // stays in the same state, having changed only what's in d
+    static StateReturn dirtied(uint8_t d) {
+        StateReturn sr;
+        sr.dirty = d;
+        return sr;
     }
 };
 
 inline StateReturn null_func() {
-    return StateReturn();
+    return StateReturn::dirtied(StateReturn::CLEAN);
 }
 
 #define REGISTER_KEY(key_id, func)                                             \
@@ -177,7 +215,8 @@ class ProgramState {
     virtual void enter() = 0;
     virtual void exit() = 0;
     virtual void register_keybinds() = 0;
-    virtual void trigger_render() = 0;
+    // dirty is what changed since the last render (see StateReturn::Dirty)
+    virtual void trigger_render(uint8_t dirty) = 0;
 
     static std::shared_ptr<TextState>
     get_first_text_state(std::optional<std::string_view> maybe_filename) {
@@ -212,7 +251,7 @@ class PromptState : public ProgramState {
 
     StateReturn handle_msg([[maybe_unused]] std::string_view msg) {
         // nothing to do rn
-        return StateReturn();
+        return StateReturn::dirtied(StateReturn::CLEAN);
     }
 
     void print(std::ostream &os) const {
@@ -280,7 +319,7 @@ class PromptState : public ProgramState {
             cmd_buf.insert(cursor, 1, (char)nc_input.id);
             move_cursor_right();
             // should cursors be part of view or state?
-            return StateReturn();
+            return StateReturn::dirtied(StateReturn::PROMPT);
         }
 
         // TODO: handle all the other modifiers for these cases
@@ -289,24 +328,24 @@ class PromptState : public ProgramState {
                 cmd_buf.erase(cursor - 1);
                 move_cursor_left();
             }
-            return StateReturn();
+            return StateReturn::dirtied(StateReturn::PROMPT);
         }
 
         if (nc_input.modifiers == 0 && nc_input.id == NCKEY_DEL) {
             if (cursor < cmd_buf.size()) {
                 cmd_buf.erase(cursor);
             }
-            return StateReturn();
+            return StateReturn::dirtied(StateReturn::PROMPT);
         }
 
         // arrow keys here
         switch (nc_input.id) {
         case NCKEY_LEFT:
             move_cursor_left();
-            return StateReturn();
+            return StateReturn::dirtied(StateReturn::PROMPT);
         case NCKEY_RIGHT:
             move_cursor_right();
-            return StateReturn();
+            return StateReturn::dirtied(StateReturn::PROMPT);
         default:
             break;
         }
@@ -324,10 +363,14 @@ class PromptState : public ProgramState {
             return StateReturn(StateReturn::Transition::EXIT);
         }
 
-        return StateReturn();
+        return StateReturn::dirtied(StateReturn::CLEAN);
     }
 
-    void trigger_render() {
+    // only the prompt line is ours to draw
+    void trigger_render(uint8_t dirty) {
+        if (!(dirty & StateReturn::PROMPT)) {
+            return;
+        }
         view_ptr->focus_cmd();
         view_ptr->render_cmd();
     }
@@ -480,8 +523,9 @@ class FileSaverState : public ProgramState {
         // nothing to register
     }
 
-    void trigger_render() {
-        // nothing to render?
+    void trigger_render([[maybe_unused]] uint8_t dirty) {
+        // nothing of ours is on screen: what the user sees is the prompt we
+        // push, and going in and out of states redraws everything anyway
     }
 
   private:
@@ -598,6 +642,9 @@ class FileOpenerState : public ProgramState {
                 text_buffer_ptr->load_contents(maybe_file_contents.value());
                 // for now we just reset this at {0, 0}
                 *text_buffer_cursor_ptr = Cursor();
+                // the new contents might be in a different language
+                event_queue_ptr->post_message("TextState:opened=" +
+                                              maybe_filename_to_open.value());
             }
             return StateReturn(StateReturn::Transition::EXIT);
         }
@@ -623,8 +670,9 @@ class FileOpenerState : public ProgramState {
     void register_keybinds() {
         // nothing to register
     }
-    void trigger_render() {
-        // nothing to render
+    void trigger_render([[maybe_unused]] uint8_t dirty) {
+        // nothing of ours is on screen: what the user sees is the prompt we
+        // push, and going in and out of states redraws everything anyway
     }
 };
 
@@ -638,8 +686,27 @@ class TextState : public ProgramState {
         *text_plane_ptr; // how do i retrigger a reparse without giving an fd?
     BottomPane *bottom_pane_ptr;
 
+    // Every pane showing this buffer, each with its own viewport and
+    // cursor. They all share the buffer, the folds and the parser (so one
+    // highlight cache). While a pane is active, its cursor and selection
+    // live in text_cursor and maybe_anchor_point, and text_plane_ptr is its
+    // plane; the copies in here are what the other panes draw.
+    struct Pane {
+        TextPlane *text_plane_ptr;
+        Cursor cursor;
+        std::optional<Cursor> maybe_anchor_point;
+    };
+    // the planes' models point in here, so it has to be address stable
+    std::list<Pane> panes;
+    std::list<Pane>::iterator active_pane;
+
     // objects used for parsing
     std::optional<Parser<TextBuffer>> maybe_parser;
+    // for buffers without a grammar; never set at the same time as the parser
+    std::optional<LineHighlighter> maybe_line_highlighter;
+
+    // closed folds; the cursor never sits inside one
+    FoldSet folds;
 
   public:
     TextState(std::optional<std::string_view> maybe_filename)
@@ -659,7 +726,17 @@ class TextState : public ProgramState {
             view_ptr->notify(file.get_errmsg());
         }
 
-        text_plane_ptr = view_ptr->add_text_plane(this->get_text_plane_model());
+        detect_grammar(maybe_filename);
+
+        panes.emplace_back();
+        active_pane = panes.begin();
+        text_plane_ptr =
+            view_ptr->add_text_plane(this->get_text_plane_model(*active_pane));
+        active_pane->text_plane_ptr = text_plane_ptr;
+        if (!EditorConfig::get().soft_wrap) {
+            text_plane_ptr->set_wrap_status(WrapStatus::NOWRAP);
+        }
+        text_plane_ptr->set_wrap_at_words(EditorConfig::get().wrap_at_words);
         bottom_pane_ptr = view_ptr->get_bottom_pane_ptr();
     }
     ~TextState() {
@@ -676,29 +753,125 @@ class TextState : public ProgramState {
         os << "{TextState }";
     }
 
-    void set_parse_lang(Parser<TextBuffer>::LANG parser_language) {
+    // returns false if the grammar couldn't be loaded
+    bool set_parse_grammar(Grammar *grammar) {
+        if (!grammar->load()) {
+            view_ptr->notify("Could not load the " + grammar->name +
+                             " grammar.");
+            return false;
+        }
+
         if (!maybe_parser) {
-            maybe_parser = Parser<TextBuffer>{&text_buffer, read_text_buffer};
+            // this runs on the parser's worker thread
+            auto on_tree_ready = []() {
+                event_queue_ptr->post_message("TextState:parsed");
+            };
+            maybe_parser = Parser<TextBuffer>{&text_buffer, read_text_buffer,
+                                              on_tree_ready};
         }
 
-        maybe_parser->set_language(parser_language);
+        maybe_parser->set_grammar(grammar);
         // need to trigger first time parse
         maybe_parser->parse_buffer();
+        maybe_line_highlighter.reset();
+        return true;
     }
 
-    TextPlaneModel get_text_plane_model() {
-        return TextPlaneModel{&text_buffer, &text_cursor, &maybe_anchor_point,
-                              &maybe_parser};
+    // picks a grammar from the file name and the buffer contents; buffers
+    // that match none fall back to a regex line syntax, or else plain text
+    void detect_grammar(std::optional<std::string_view> maybe_filename) {
+        GrammarRegistry &registry = GrammarRegistry::get();
+        Grammar *grammar = registry.detect(maybe_filename, text_buffer);
+        if (grammar && set_parse_grammar(grammar)) {
+            return;
+        }
+        maybe_parser.reset();
+        maybe_line_highlighter.reset();
+
+        LineSyntax *syntax =
+            registry.detect_line_syntax(maybe_filename, text_buffer);
+        if (syntax && syntax->load()) {
+            maybe_line_highlighter.emplace(syntax);
+            maybe_line_highlighter->reset(text_buffer.num_lines());
+        }
     }
 
-    StateReturn handle_msg([[maybe_unused]] std::string_view msg) {
-        // for now ignore it
-        return StateReturn();
+    TextPlaneModel get_text_plane_model(Pane &pane) {
+        return TextPlaneModel{&text_buffer,   &pane.cursor,
+                              &pane.maybe_anchor_point, &maybe_parser,
+                              &maybe_line_highlighter,  &folds};
     }
 
-    void trigger_render() {
-        view_ptr->focus_text();
-        text_plane_ptr->render();
+    StateReturn handle_msg(std::string_view msg) {
+        if (msg == "TextState:parsed" && maybe_parser) {
+            // new highlights, and maybe a new language name; the tree may
+            // already have been picked up at the last render
+            if (!maybe_parser->poll_tree()) {
+                return StateReturn::dirtied(StateReturn::CLEAN);
+            }
+            return StateReturn::dirtied(StateReturn::TEXT |
+                                        StateReturn::STATUS);
+        }
+        if (msg.starts_with("TextState:opened=")) {
+            folds.clear();
+            for (Pane &pane : panes) {
+                pane.text_plane_ptr->invalidate_layout();
+                if (&pane != &*active_pane) {
+                    pane.cursor = Cursor{};
+                    pane.maybe_anchor_point.reset();
+                }
+            }
+            detect_grammar(msg.substr(17));
+            return StateReturn();
+        }
+        // for now ignore everything else
+        return StateReturn::dirtied(StateReturn::CLEAN);
+    }
+
+    void trigger_render(uint8_t dirty) {
+        if (maybe_parser) {
+            // large files only get the part around the screen parsed
+            auto [first_row, last_row] = text_plane_ptr->get_visible_rows();
+            maybe_parser->set_viewport(first_row, last_row);
+            // one parse per frame, no matter how many edits came in
+            maybe_parser->flush_edits();
+            // we might have missed the message if another state was active
+            if (maybe_parser->poll_tree()) {
+                dirty |= StateReturn::TEXT | StateReturn::STATUS;
+            }
+        }
+
+        // moving sideways (or editing) into a fold opens it up
+        if (folds.is_hidden(text_cursor.row)) {
+            folds.unfold_at(text_cursor.row);
+            text_plane_ptr->chase_point(text_cursor);
+            dirty |= StateReturn::TEXT;
+        }
+
+        // what the active pane draws lives in text_cursor for now
+        active_pane->cursor = text_cursor;
+        active_pane->maybe_anchor_point = maybe_anchor_point;
+
+        if (dirty & StateReturn::TEXT) {
+            view_ptr->focus_text();
+            text_plane_ptr->render();
+        } else if (dirty & StateReturn::CURSOR) {
+            view_ptr->focus_text();
+            text_plane_ptr->render_cursor_move();
+        }
+        // the other panes only change along with the text
+        if (dirty & StateReturn::TEXT) {
+            for (Pane &pane : panes) {
+                if (&pane != &*active_pane) {
+                    pane.text_plane_ptr->render();
+                }
+            }
+        }
+
+        // the status bar shows where the cursor is
+        if (!(dirty & (StateReturn::STATUS | StateReturn::CURSOR))) {
+            return;
+        }
 
         std::string status_str =
             "Line " + std::to_string(text_cursor.row) + ", Column " +
@@ -709,6 +882,8 @@ class TextState : public ProgramState {
         std::string_view lang_name = "Text Mode";
         if (maybe_parser) {
             lang_name = maybe_parser->get_parser_lang_name();
+        } else if (maybe_line_highlighter) {
+            lang_name = maybe_line_highlighter->get_syntax_name();
         }
 
         size_t remaining_pad_length =
@@ -725,6 +900,10 @@ class TextState : public ProgramState {
         if (nc_input.modifiers == 0 &&
             ((nc_input.id >= 32 && nc_input.id <= 255) ||
              nc_input.id == NCKEY_TAB)) {
+            if (std::optional<StateReturn> maybe_sr =
+                    insert_typed_run((char)nc_input.id)) {
+                return *maybe_sr;
+            }
 
             Cursor update_start_point = text_cursor;
             size_t start_byte =
@@ -762,7 +941,8 @@ class TextState : public ProgramState {
                          new_end_byte);
 
             text_plane_ptr->chase_point(text_cursor);
-            return StateReturn();
+            return StateReturn::dirtied(StateReturn::TEXT |
+                                        StateReturn::CURSOR);
         }
 
         // TODO: handle unicode insertions
@@ -773,6 +953,9 @@ class TextState : public ProgramState {
         }
 
         if (nc_input.modifiers == 0 && nc_input.id == NCKEY_ENTER) {
+            if (std::optional<StateReturn> maybe_sr = insert_typed_run('\n')) {
+                return *maybe_sr;
+            }
 
             Cursor update_start_point = text_cursor;
             Cursor update_old_end_point = text_cursor;
@@ -811,7 +994,8 @@ class TextState : public ProgramState {
                          new_end_byte);
 
             text_plane_ptr->chase_point(text_cursor);
-            return StateReturn();
+            return StateReturn::dirtied(StateReturn::TEXT |
+                                        StateReturn::CURSOR);
         }
 
         if (nc_input.modifiers == 0 && nc_input.id == NCKEY_DEL) {
@@ -876,6 +1060,28 @@ class TextState : public ProgramState {
         // Ctrl P
         REGISTER_MODDED_KEY('P', NCKEY_MOD_CTRL, &TextState::CTRL_P_HANDLER);
 
+        // Folding
+        REGISTER_KEY(NCKEY_F03, &TextState::F3_HANDLER);
+        REGISTER_KEY(NCKEY_F04, &TextState::F4_HANDLER);
+
+        // Soft wrap
+        REGISTER_KEY(NCKEY_F06, &TextState::F6_HANDLER);
+        REGISTER_MODDED_KEY(NCKEY_F06, NCKEY_MOD_SHIFT,
+                            &TextState::SHIFT_F6_HANDLER);
+
+        // Split panes
+        REGISTER_KEY(NCKEY_F09, &TextState::F9_HANDLER);
+        REGISTER_MODDED_KEY(NCKEY_F09, NCKEY_MOD_SHIFT,
+                            &TextState::SHIFT_F9_HANDLER);
+        REGISTER_KEY(NCKEY_F10, &TextState::F10_HANDLER);
+        REGISTER_MODDED_KEY(NCKEY_F10, NCKEY_MOD_SHIFT,
+                            &TextState::SHIFT_F10_HANDLER);
+
+        // Syntax errors
+        REGISTER_KEY(NCKEY_F08, &TextState::F8_HANDLER);
+        REGISTER_MODDED_KEY(NCKEY_F08, NCKEY_MOD_SHIFT,
+                            &TextState::SHIFT_F8_HANDLER);
+
         // File manipulators
         REGISTER_MODDED_KEY('O', NCKEY_MOD_CTRL, &TextState::CTRL_O_HANDLER);
         REGISTER_MODDED_KEY('R', NCKEY_MOD_CTRL, &TextState::CTRL_R_HANDLER);
@@ -897,7 +1103,7 @@ class TextState : public ProgramState {
         }
         text_plane_ptr->chase_point(text_cursor);
 
-        return StateReturn();
+        return StateReturn::dirtied(StateReturn::CURSOR);
     }
     StateReturn RIGHT_ARROW_HANDLER() {
         if (maybe_anchor_point) {
@@ -908,7 +1114,7 @@ class TextState : public ProgramState {
         }
         text_plane_ptr->chase_point(text_cursor);
 
-        return StateReturn();
+        return StateReturn::dirtied(StateReturn::CURSOR);
     }
     StateReturn UP_ARROW_HANDLER() {
         if (maybe_anchor_point) {
@@ -918,7 +1124,7 @@ class TextState : public ProgramState {
         text_cursor = move_cursor_up(text_cursor);
         text_plane_ptr->chase_point(text_cursor);
 
-        return StateReturn();
+        return StateReturn::dirtied(StateReturn::CURSOR);
     }
     StateReturn DOWN_ARROW_HANDLER() {
         if (maybe_anchor_point) {
@@ -928,7 +1134,7 @@ class TextState : public ProgramState {
         text_cursor = move_cursor_down(text_cursor);
         text_plane_ptr->chase_point(text_cursor);
 
-        return StateReturn();
+        return StateReturn::dirtied(StateReturn::CURSOR);
     }
 
     StateReturn SHIFT_LEFT_ARROW_HANDLER() {
@@ -943,7 +1149,7 @@ class TextState : public ProgramState {
         if (*maybe_anchor_point == text_cursor) {
             maybe_anchor_point.reset();
         }
-        return StateReturn();
+        return StateReturn::dirtied(StateReturn::CURSOR);
     }
     StateReturn SHIFT_RIGHT_ARROW_HANDLER() {
         if (!maybe_anchor_point) {
@@ -957,7 +1163,7 @@ class TextState : public ProgramState {
         if (*maybe_anchor_point == text_cursor) {
             maybe_anchor_point.reset();
         }
-        return StateReturn();
+        return StateReturn::dirtied(StateReturn::CURSOR);
     }
     StateReturn SHIFT_UP_ARROW_HANDLER() {
         if (!maybe_anchor_point) {
@@ -971,7 +1177,7 @@ class TextState : public ProgramState {
         if (*maybe_anchor_point == text_cursor) {
             maybe_anchor_point.reset();
         }
-        return StateReturn();
+        return StateReturn::dirtied(StateReturn::CURSOR);
     }
     StateReturn SHIFT_DOWN_ARROW_HANDLER() {
         if (!maybe_anchor_point) {
@@ -985,7 +1191,7 @@ class TextState : public ProgramState {
         if (*maybe_anchor_point == text_cursor) {
             maybe_anchor_point.reset();
         }
-        return StateReturn();
+        return StateReturn::dirtied(StateReturn::CURSOR);
     }
 
     // Word Boundary movement
@@ -994,24 +1200,24 @@ class TextState : public ProgramState {
         maybe_anchor_point.reset();
         text_cursor = move_cursor_left_over_boundary(text_cursor);
 
-        return StateReturn();
+        return StateReturn::dirtied(StateReturn::CURSOR);
     }
 
     StateReturn CTRL_RIGHT_ARROW_HANDLER() {
         maybe_anchor_point.reset();
         text_cursor = move_cursor_right_over_boundary(text_cursor);
 
-        return StateReturn();
+        return StateReturn::dirtied(StateReturn::CURSOR);
     }
 
     StateReturn CTRL_UP_HANDLER() {
         text_plane_ptr->visual_scroll_up();
-        return StateReturn();
+        return StateReturn::dirtied(StateReturn::CURSOR);
     }
 
     StateReturn CTRL_DOWN_HANDLER() {
         text_plane_ptr->visual_scroll_down();
-        return StateReturn();
+        return StateReturn::dirtied(StateReturn::CURSOR);
     }
 
     StateReturn BACKSPACE_HANDLER() {
@@ -1058,7 +1264,7 @@ class TextState : public ProgramState {
                          new_end_byte);
         }
         text_plane_ptr->chase_point(text_cursor);
-        return StateReturn();
+        return StateReturn::dirtied(StateReturn::TEXT | StateReturn::CURSOR);
     }
 
     StateReturn DELETE_HANDLER() {
@@ -1102,7 +1308,7 @@ class TextState : public ProgramState {
         }
 
         text_plane_ptr->chase_point(text_cursor);
-        return StateReturn();
+        return StateReturn::dirtied(StateReturn::TEXT | StateReturn::CURSOR);
     }
 
     StateReturn CTRL_DELETE_HANDLER() {
@@ -1152,7 +1358,7 @@ class TextState : public ProgramState {
                 text_buffer.at(text_cursor.row + 1).size());
         }
         text_plane_ptr->chase_point(text_cursor);
-        return StateReturn();
+        return StateReturn::dirtied(StateReturn::TEXT | StateReturn::CURSOR);
     }
 
     StateReturn ALT_DOWN_HANDLER() {
@@ -1181,7 +1387,7 @@ class TextState : public ProgramState {
                 text_buffer.at(text_cursor.row - 1).size());
         }
         text_plane_ptr->chase_point(text_cursor);
-        return StateReturn();
+        return StateReturn::dirtied(StateReturn::TEXT | StateReturn::CURSOR);
     }
 
     StateReturn CTRL_SHIFT_LEFT_ARROW_HANDLER() {
@@ -1198,7 +1404,7 @@ class TextState : public ProgramState {
             maybe_anchor_point.reset();
         }
 
-        return StateReturn();
+        return StateReturn::dirtied(StateReturn::CURSOR);
     }
 
     StateReturn CTRL_SHIFT_RIGHT_ARROW_HANDLER() {
@@ -1215,7 +1421,7 @@ class TextState : public ProgramState {
             maybe_anchor_point.reset();
         }
 
-        return StateReturn();
+        return StateReturn::dirtied(StateReturn::CURSOR);
     }
 
     StateReturn CTRL_ENTER_HANDLER() {
@@ -1229,9 +1435,13 @@ class TextState : public ProgramState {
                               text_buffer.at(text_cursor.row).size(),
                               StringUtils::var_width_str_into_effective_width(
                                   text_buffer.at(text_cursor.row))};
+        size_t start_byte = text_buffer.get_offset_from_point(end_of_line);
         text_buffer.insert_newline_at(end_of_line);
         text_cursor = Cursor{text_cursor.row + 1, 0, 0};
-        return StateReturn();
+        reparse_text(end_of_line, end_of_line, text_cursor, start_byte,
+                     start_byte,
+                     text_buffer.get_offset_from_point(text_cursor));
+        return StateReturn::dirtied(StateReturn::TEXT | StateReturn::CURSOR);
     }
 
     StateReturn CTRL_SHIFT_ENTER_HANDLER() {
@@ -1242,8 +1452,13 @@ class TextState : public ProgramState {
 
         // insert newline the end of current position
         Cursor begin_of_line = {text_cursor.row, 0, 0};
+        size_t start_byte = text_buffer.get_offset_from_point(begin_of_line);
         text_buffer.insert_newline_at(begin_of_line);
-        return StateReturn();
+        Cursor new_end_point = {text_cursor.row + 1, 0, 0};
+        reparse_text(begin_of_line, begin_of_line, new_end_point, start_byte,
+                     start_byte,
+                     text_buffer.get_offset_from_point(new_end_point));
+        return StateReturn::dirtied(StateReturn::TEXT | StateReturn::CURSOR);
     }
 
     // Clipboard manip
@@ -1255,7 +1470,7 @@ class TextState : public ProgramState {
         } else {
             // for now do nothing
         }
-        return StateReturn();
+        return StateReturn::dirtied(StateReturn::CLEAN);
     }
 
     // Cut
@@ -1275,51 +1490,188 @@ class TextState : public ProgramState {
                          old_end_offset, text_buffer.get_offset_from_point(lp));
         } else {
             // for now do nothing
+            return StateReturn::dirtied(StateReturn::CLEAN);
         }
-        return StateReturn();
+        return StateReturn::dirtied(StateReturn::TEXT | StateReturn::CURSOR);
         // quit selection mode
     }
 
     // Paste
     StateReturn CTRL_V_HANLDER() {
         if (clipboard.empty()) {
-            return StateReturn();
+            return StateReturn::dirtied(StateReturn::CLEAN);
         }
+        replace_selection_with(clipboard);
+        return StateReturn::dirtied(StateReturn::TEXT | StateReturn::CURSOR);
+    }
 
+    // puts lines in place of the selection (or at the cursor) as one edit,
+    // with one reparse
+    void replace_selection_with(std::vector<std::string> lines) {
         auto old_left = text_cursor;
         auto old_right = text_cursor;
-        auto old_end_byte_offset = text_buffer.get_offset_from_point(old_right);
-
         if (maybe_anchor_point) {
-            auto [lp, rp] = std::minmax(*maybe_anchor_point, text_cursor);
-
-            old_left = lp;
-            old_right = rp;
-            old_end_byte_offset = text_buffer.get_offset_from_point(old_right);
+            std::tie(old_left, old_right) =
+                std::minmax(*maybe_anchor_point, text_cursor);
+        }
+        size_t start_byte = text_buffer.get_offset_from_point(old_left);
+        size_t old_end_byte = text_buffer.get_offset_from_point(old_right);
 
-            text_buffer.remove_text_at(lp, rp);
-            text_cursor = lp;
-            text_plane_ptr->chase_point(text_cursor);
+        if (maybe_anchor_point) {
+            text_buffer.remove_text_at(old_left, old_right);
+            text_cursor = old_left;
         }
-        text_cursor = text_buffer.insert_text_at(text_cursor, clipboard);
+        text_cursor = text_buffer.insert_text_at(text_cursor, std::move(lines));
         maybe_anchor_point.reset();
-        text_plane_ptr->chase_point(text_cursor);
         auto new_right = text_cursor;
 
-        reparse_text(old_left, old_right, new_right,
-                     text_buffer.get_offset_from_point(old_left),
-                     old_end_byte_offset,
+        reparse_text(old_left, old_right, new_right, start_byte, old_end_byte,
                      text_buffer.get_offset_from_point(new_right));
+        text_plane_ptr->chase_point(text_cursor);
+    }
 
-        return StateReturn();
+    // a key that was typed, plus whatever text input came in right behind
+    // it. Usually that's nothing, but a paste arrives all at once, and it's
+    // far cheaper to insert it in one go than key by key.
+    std::optional<StateReturn> insert_typed_run(char first) {
+        std::string typed = event_queue_ptr->take_typed_text();
+        if (typed.empty()) {
+            return std::nullopt;
+        }
+        typed.insert(typed.begin(), first);
+
+        std::vector<std::string> lines(1);
+        for (char ch : typed) {
+            if (ch == '\n') {
+                lines.emplace_back();
+            } else {
+                lines.back().push_back(ch);
+            }
+        }
+        replace_selection_with(std::move(lines));
+        return StateReturn::dirtied(StateReturn::TEXT | StateReturn::CURSOR);
     }
 
     // Parse
     StateReturn CTRL_P_HANDLER() {
-        set_parse_lang(Parser<TextBuffer>::LANG::CPP);
+        // for files we couldn't detect anything for
+        if (Grammar *grammar = GrammarRegistry::get().find_by_name("C++")) {
+            set_parse_grammar(grammar);
+        }
         return StateReturn();
     }
 
+    // Toggle the fold at the cursor
+    StateReturn F3_HANDLER() {
+        if (folds.unfold_at(text_cursor.row)) {
+            return StateReturn::dirtied(StateReturn::TEXT |
+                                        StateReturn::CURSOR);
+        }
+
+        // plain text gets folded by indentation instead
+        std::optional<FoldSet::RowRange> maybe_range =
+            (maybe_parser && maybe_parser->has_tree())
+                ? maybe_parser->get_fold_range(text_cursor.row)
+                : IndentFolds::fold_range(text_buffer, text_cursor.row);
+        if (!maybe_range) {
+            return StateReturn::dirtied(StateReturn::CLEAN);
+        }
+
+        // a tree that's behind on edits may point past the end
+        size_t last_row =
+            std::min(maybe_range->second, text_buffer.num_lines() - 1);
+        if (folds.fold(maybe_range->first, last_row)) {
+            move_cursor_out_of_folds();
+        }
+        return StateReturn::dirtied(StateReturn::TEXT | StateReturn::CURSOR);
+    }
+
+    // Fold everything, or unfold everything if anything is folded
+    StateReturn F4_HANDLER() {
+        if (!folds.empty()) {
+            folds.clear();
+            return StateReturn::dirtied(StateReturn::TEXT |
+                                        StateReturn::CURSOR);
+        }
+
+        std::vector<FoldSet::RowRange> ranges =
+            (maybe_parser && maybe_parser->has_tree())
+                ? maybe_parser->get_fold_ranges()
+                : IndentFolds::outermost_fold_ranges(text_buffer);
+        for (auto [header_row, last_row] : ranges) {
+            folds.fold(header_row,
+                       std::min(last_row, text_buffer.num_lines() - 1));
+        }
+        move_cursor_out_of_folds();
+        return StateReturn::dirtied(StateReturn::TEXT | StateReturn::CURSOR);
+    }
+
+    // Toggle soft wrap; with it off, long rows scroll sideways instead
+    StateReturn F6_HANDLER() {
+        WrapStatus ws = (text_plane_ptr->get_wrap_status() == WrapStatus::WRAP)
+                            ? WrapStatus::NOWRAP
+                            : WrapStatus::WRAP;
+        text_plane_ptr->set_wrap_status(ws);
+        text_plane_ptr->chase_point(text_cursor);
+        return StateReturn::dirtied(StateReturn::CURSOR);
+    }
+
+    // Toggle between wrapping at words and wrapping anywhere
+    StateReturn SHIFT_F6_HANDLER() {
+        text_plane_ptr->set_wrap_at_words(
+            !text_plane_ptr->get_wrap_at_words());
+        text_plane_ptr->chase_point(text_cursor);
+        return StateReturn::dirtied(StateReturn::CURSOR);
+    }
+
+    // Split the pane side by side
+    StateReturn F9_HANDLER() {
+        split_pane(Split::VERTICAL);
+        return StateReturn();
+    }
+
+    // Split the pane top and bottom
+    StateReturn SHIFT_F9_HANDLER() {
+        split_pane(Split::HORIZONTAL);
+        return StateReturn();
+    }
+
+    // Move to the next pane
+    StateReturn F10_HANDLER() {
+        auto next_pane = std::next(active_pane);
+        activate_pane(next_pane == panes.end() ? panes.begin() : next_pane);
+        return StateReturn();
+    }
+
+    // Close the pane, unless it's the last one
+    StateReturn SHIFT_F10_HANDLER() {
+        if (panes.size() == 1 ||
+            !view_ptr->close_text_plane(active_pane->text_plane_ptr)) {
+            return StateReturn::dirtied(StateReturn::CLEAN);
+        }
+        auto next_pane = panes.erase(active_pane);
+        // nothing to save from the pane that's gone
+        active_pane = panes.end();
+        activate_pane(next_pane == panes.end() ? panes.begin() : next_pane);
+        return StateReturn();
+    }
+
+    // Jump to the next syntax error
+    StateReturn F8_HANDLER() {
+        if (maybe_parser) {
+            jump_to_error(maybe_parser->next_error(text_cursor));
+        }
+        return StateReturn::dirtied(StateReturn::CURSOR);
+    }
+
+    // Jump to the previous syntax error
+    StateReturn SHIFT_F8_HANDLER() {
+        if (maybe_parser) {
+            jump_to_error(maybe_parser->prev_error(text_cursor));
+        }
+        return StateReturn::dirtied(StateReturn::CURSOR);
+    }
+
     // Handlers that cause state changes
 
     // Open
@@ -1336,12 +1688,43 @@ class TextState : public ProgramState {
     // Search
     StateReturn CTRL_W_HANDLER() {
         // Enter the search State?
-        return StateReturn();
+        return StateReturn::dirtied(StateReturn::CLEAN);
     }
 
     // >>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>> Other stuff
 
     // =============== Helper Methods
+    void jump_to_error(std::optional<Point> maybe_error_point) {
+        if (!maybe_error_point) {
+            view_ptr->notify("No syntax errors.");
+            return;
+        }
+
+        // a tree that's behind on edits may point past the end
+        size_t row =
+            std::min(maybe_error_point->row, text_buffer.num_lines() - 1);
+        std::string_view line = text_buffer.at(row);
+        size_t col = std::min(maybe_error_point->col, line.size());
+        size_t effective_col = StringUtils::var_width_str_into_effective_width(
+            line.substr(0, col));
+        text_cursor = Cursor{row, col, effective_col};
+        maybe_anchor_point.reset();
+        text_plane_ptr->chase_point(text_cursor);
+        view_ptr->notify("Syntax errors: " +
+                         std::to_string(maybe_parser->num_errors()));
+    }
+
+    // puts the cursor on the header of the fold that just closed over it
+    void move_cursor_out_of_folds() {
+        if (!folds.is_hidden(text_cursor.row)) {
+            return;
+        }
+        size_t header_row = folds.visible_row_for(text_cursor.row);
+        text_cursor = Cursor{header_row, 0, 0};
+        maybe_anchor_point.reset();
+        text_plane_ptr->chase_point(text_cursor);
+    }
+
     Cursor move_cursor_right(Cursor const &p) const {
         Cursor to_return = p;
         if (to_return.col == text_buffer.at(to_return.row).size() &&
@@ -1362,32 +1745,37 @@ class TextState : public ProgramState {
         Cursor to_return = p;
         if (text_plane_ptr->get_wrap_status() == WrapStatus::NOWRAP) {
             // non-wrapping movement
+            to_return.row = folds.prev_visible_row(to_return.row);
             to_return.col =
-                std::min(to_return.col, text_buffer.at(--to_return.row).size());
+                std::min(to_return.col, text_buffer.at(to_return.row).size());
             return to_return;
         }
 
-        auto [num_rows, num_cols] = text_plane_ptr->get_plane_yx_dim();
-        // first is col, second is effective width
-
-        // returns the point moved up on the line
-        // unless it cannot do that
-        std::optional<Cursor> maybe_up_point = StringUtils::maybe_up_point(
-            text_buffer.at(to_return.row), to_return, num_cols);
-
-        if (maybe_up_point) {
-            return maybe_up_point.value();
+        // aim for the same distance into the visual row we land on
+        std::vector<std::pair<size_t, size_t>> const &chunk_starts =
+            text_plane_ptr->get_wrap_breaks(to_return.row);
+        size_t chunk_idx =
+            StringUtils::chunk_of_col(chunk_starts, to_return.col);
+        size_t offset =
+            to_return.effective_col - chunk_starts[chunk_idx].second;
+        if (chunk_idx > 0) {
+            return StringUtils::point_in_chunk(text_buffer.at(to_return.row),
+                                               to_return.row, chunk_starts,
+                                               chunk_idx - 1, offset);
         }
+
         // then it was already on its first chunk.
         if (to_return.row == 0) {
             to_return.col = 0;
             to_return.effective_col = 0;
-        } else {
-            return StringUtils::final_chunk(text_buffer.at(--to_return.row),
-                                            to_return, num_cols);
+            return to_return;
         }
-
-        return to_return;
+        to_return.row = folds.prev_visible_row(to_return.row);
+        std::vector<std::pair<size_t, size_t>> const &prev_chunk_starts =
+            text_plane_ptr->get_wrap_breaks(to_return.row);
+        return StringUtils::point_in_chunk(
+            text_buffer.at(to_return.row), to_return.row, prev_chunk_starts,
+            prev_chunk_starts.size() - 1, offset);
     }
 
     Cursor move_cursor_down(Cursor const &p) const {
@@ -1395,38 +1783,39 @@ class TextState : public ProgramState {
 
         if (text_plane_ptr->get_wrap_status() == WrapStatus::NOWRAP) {
             // non-wrapping movement
-            if (to_return.row + 1 < text_buffer.num_lines()) {
-                ++to_return.row;
+            if (folds.next_visible_row(to_return.row) <
+                text_buffer.num_lines()) {
+                to_return.row = folds.next_visible_row(to_return.row);
                 to_return.col = std::min(to_return.col,
                                          text_buffer.at(to_return.row).size());
             }
             return to_return;
         }
 
-        auto [num_rows, num_cols] = text_plane_ptr->get_plane_yx_dim();
-
-        std::optional<Cursor> maybe_down_point = StringUtils::maybe_down_point(
-            text_buffer.at(to_return.row), to_return, num_cols);
-
-        if (maybe_down_point) {
-            return maybe_down_point.value();
+        std::vector<std::pair<size_t, size_t>> const &chunk_starts =
+            text_plane_ptr->get_wrap_breaks(to_return.row);
+        size_t chunk_idx =
+            StringUtils::chunk_of_col(chunk_starts, to_return.col);
+        size_t offset =
+            to_return.effective_col - chunk_starts[chunk_idx].second;
+        if (chunk_idx + 1 < chunk_starts.size()) {
+            return StringUtils::point_in_chunk(text_buffer.at(to_return.row),
+                                               to_return.row, chunk_starts,
+                                               chunk_idx + 1, offset);
         }
 
         // then it was already on its last chunk.
-        if (to_return.row == text_buffer.num_lines() - 1) {
-
+        if (folds.next_visible_row(to_return.row) >= text_buffer.num_lines()) {
             to_return.col = text_buffer.at(to_return.row).size();
             to_return.effective_col =
                 StringUtils::var_width_str_into_effective_width(
                     text_buffer.at(to_return.row));
-
             return to_return;
-        } else {
-            return StringUtils::first_chunk(text_buffer.at(++to_return.row),
-                                            to_return, num_cols);
         }
-
-        return to_return;
+        to_return.row = folds.next_visible_row(to_return.row);
+        return StringUtils::point_in_chunk(
+            text_buffer.at(to_return.row), to_return.row,
+            text_plane_ptr->get_wrap_breaks(to_return.row), 0, offset);
     }
 
     Cursor move_cursor_left(Cursor const &p) const {
@@ -1501,10 +1890,32 @@ class TextState : public ProgramState {
         return cursor_to_return;
     }
 
-    // call this to update the parser
+    // call this to let the parser know about an edit; the actual parse is
+    // deferred until the next trigger_render
     void reparse_text(Cursor start_point, Cursor old_end_point,
                       Cursor new_end_point, size_t start_byte,
                       size_t old_end_byte, size_t new_end_byte) {
+        folds.apply_edit(start_point.row, old_end_point.row, new_end_point.row);
+        for (Pane &pane : panes) {
+            pane.text_plane_ptr->apply_edit(start_point, old_end_point,
+                                            new_end_point);
+            if (&pane == &*active_pane) {
+                continue;
+            }
+            // keep the other cursors on the same text
+            pane.cursor = shift_past_edit(pane.cursor, start_point,
+                                          old_end_point, new_end_point);
+            if (pane.maybe_anchor_point) {
+                pane.maybe_anchor_point =
+                    shift_past_edit(*pane.maybe_anchor_point, start_point,
+                                    old_end_point, new_end_point);
+            }
+        }
+        if (maybe_line_highlighter) {
+            maybe_line_highlighter->apply_edit(
+                start_point.row, old_end_point.row, new_end_point.row);
+        }
+
         // quit if there is no parser
         if (!maybe_parser) {
             return;
@@ -1518,6 +1929,67 @@ class TextState : public ProgramState {
   private:
     // some helper functions:
 
+    // a new pane in half of the active one, looking at the same spot
+    void split_pane(Split split) {
+        Pane &new_pane = panes.emplace_back(Pane{.text_plane_ptr = nullptr,
+                                                 .cursor = text_cursor,
+                                                 .maybe_anchor_point =
+                                                     maybe_anchor_point});
+        TextPlane *new_plane_ptr = view_ptr->split_text_plane(
+            text_plane_ptr, split, get_text_plane_model(new_pane));
+        if (!new_plane_ptr) {
+            panes.pop_back();
+            view_ptr->notify("Not enough room to split this pane.");
+            return;
+        }
+        new_pane.text_plane_ptr = new_plane_ptr;
+        new_plane_ptr->set_wrap_status(text_plane_ptr->get_wrap_status());
+        new_plane_ptr->set_wrap_at_words(text_plane_ptr->get_wrap_at_words());
+
+        // both halves are smaller now
+        text_plane_ptr->chase_point(text_cursor);
+        new_plane_ptr->chase_point(text_cursor);
+        activate_pane(std::prev(panes.end()));
+    }
+
+    // makes pane the one that takes input
+    void activate_pane(std::list<Pane>::iterator pane) {
+        if (active_pane != panes.end()) {
+            active_pane->cursor = text_cursor;
+            active_pane->maybe_anchor_point = maybe_anchor_point;
+        }
+        active_pane = pane;
+        text_cursor = active_pane->cursor;
+        maybe_anchor_point = active_pane->maybe_anchor_point;
+        text_plane_ptr = active_pane->text_plane_ptr;
+        view_ptr->set_active_text_plane(text_plane_ptr);
+    }
+
+    // where p ends up after [start, old_end) got replaced by
+    // [start, new_end); points inside the replaced text go to its end
+    Cursor shift_past_edit(Cursor p, Point start, Point old_end,
+                           Point new_end) const {
+        if (p < start) {
+            return p;
+        }
+        Point moved = new_end;
+        if (p >= old_end) {
+            if (p.row == old_end.row) {
+                moved.col = new_end.col + (p.col - old_end.col);
+            } else {
+                moved.row = new_end.row + (p.row - old_end.row);
+                moved.col = p.col;
+            }
+        }
+        // in case that didn't quite land on the text
+        moved.row = std::min(moved.row, text_buffer.num_lines() - 1);
+        std::string_view line = text_buffer.at(moved.row);
+        moved.col = std::min(moved.col, line.size());
+        return Cursor{moved.row, moved.col,
+                      StringUtils::var_width_str_into_effective_width(
+                          line.substr(0, moved.col))};
+    }
+
     enum class CharType {
         ALPHA_NUMERIC_UNDERSCORE,
         WHITESPACE,
@@ -1543,9 +2015,8 @@ struct StateStack {
     std::vector<ProgramState *> state_stack;
 
     ~StateStack() {
-        while (state_stack.empty()) {
-            delete state_stack.back();
-            state_stack.pop_back();
+        while (!state_stack.empty()) {
+            pop();
         }
     }
 
@@ -1608,39 +2079,115 @@ struct Program {
         state_stack.initial_setup(maybe_filename);
     }
 
+    ~Program() {
+        // states may own worker threads that post into event_queue, so make
+        // sure they're gone before it is
+        while (!state_stack.empty()) {
+            state_stack.pop();
+        }
+    }
+
     void run_event_loop() {
+        using Clock = std::chrono::steady_clock;
+
+        int max_fps = EditorConfig::get().max_fps;
+        Clock::duration const frame_interval =
+            max_fps > 0 ? Clock::duration{std::chrono::seconds{1}} / max_fps
+                        : Clock::duration::zero();
+
         assert(!state_stack.empty());
         state_stack.active_state()->enter();
+        // what's changed since the last render
+        uint8_t dirty = StateReturn::ALL;
+        Clock::time_point next_frame = Clock::now();
         while (!state_stack.empty()) {
 
-            // view.render_status();
-            state_stack.active_state()->trigger_render();
-            view.refresh_screen();
-            Event ev = event_queue.get_event();
+            // nothing changed, nothing to draw
+            if (dirty != StateReturn::CLEAN) {
+                // view.render_status();
+                state_stack.active_state()->trigger_render(dirty);
+                view.refresh_screen();
+                next_frame = Clock::now() + frame_interval;
+                dirty = StateReturn::CLEAN;
+            }
 
-            // for now handle quitting here
-            if (ev.is_input() && ev.get_input().id == 'W' &&
-                ev.get_input().modifiers == NCKEY_MOD_CTRL) {
+            // block for the first event, then apply everything else that's
+            // already waiting before rendering again, so a burst of input
+            // (key repeat, a paste) costs one render instead of one per key.
+            if (!dispatch_event(event_queue.get_event(), dirty)) {
                 break;
             }
-
-            // TODO: eventually we need to bubble up unhandled
-            // events
-            StateReturn sr = state_stack.active_state()->handle_event(ev);
-            switch (sr.transition_type) {
-                using enum StateReturn::Transition;
-            case ENTER: {
-                state_stack.push(sr.next_state_ptr);
-                state_stack.active_state()->enter();
-            } break;
-            case EXIT: {
-                state_stack.active_state()->exit();
-                state_stack.pop();
+            bool quit = false;
+            while (!state_stack.empty()) {
+                std::optional<Event> maybe_ev = event_queue.poll_event();
+                if (!maybe_ev) {
+                    // nothing left; if it's too soon to draw again, give
+                    // more input the rest of the frame to turn up
+                    auto remaining = next_frame - Clock::now();
+                    if (remaining <= Clock::duration::zero() ||
+                        !event_queue.wait_for_event(to_timeout_ms(remaining))) {
+                        break;
+                    }
+                    continue;
+                }
+                if (!dispatch_event(*maybe_ev, dirty)) {
+                    quit = true;
+                    break;
+                }
+                // don't let a long burst freeze the screen
+                if (frame_interval != Clock::duration::zero() &&
+                    Clock::now() >= next_frame + frame_interval) {
+                    break;
+                }
             }
-            // TODO: handle bubbling inputs
-            default:
+            if (quit) {
                 break;
             }
         }
     }
+
+  private:
+    // hands ev to the active state, applies its transition and adds what it
+    // changed to dirty. Returns false if ev asked to quit.
+    bool dispatch_event(Event const &ev, uint8_t &dirty) {
+        // for now handle quitting here
+        if (ev.is_input() && ev.get_input().id == 'W' &&
+            ev.get_input().modifiers == NCKEY_MOD_CTRL) {
+            return false;
+        }
+
+        // the terminal changed size, so everything has to be redrawn
+        if (ev.is_input() && ev.get_input().id == NCKEY_RESIZE) {
+            dirty = StateReturn::ALL;
+        }
+
+        // TODO: eventually we need to bubble up unhandled
+        // events
+        StateReturn sr = state_stack.active_state()->handle_event(ev);
+        dirty |= sr.dirty;
+        switch (sr.transition_type) {
+            using enum StateReturn::Transition;
+        case ENTER: {
+            state_stack.push(sr.next_state_ptr);
+            state_stack.active_state()->enter();
+            // a different state draws next time
+            dirty = StateReturn::ALL;
+        } break;
+        case EXIT: {
+            state_stack.active_state()->exit();
+            state_stack.pop();
+            dirty = StateReturn::ALL;
+        }
+        // TODO: handle bubbling inputs
+        default:
+            break;
+        }
+        return true;
+    }
+
+    // rounded up, so we never wake up just before the deadline
+    static int to_timeout_ms(std::chrono::steady_clock::duration d) {
+        auto ms = std::chrono::ceil<std::chrono::milliseconds>(d);
+        return (int)std::max<std::chrono::milliseconds::rep>(ms.count(), 1);
+    }
 };
@@ -0,0 +1,304 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <algorithm>
+#include <iterator>
+#include <optional>
+#include <regex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include <tree_sitter/api.h>
+
+// Walks the text between two points of a buffer as if it were one string,
+// yielding '\n' between lines. Lets us compare and regex-match node text
+// in place, without copying it out first. T needs at() and num_lines().
+template <typename T> class BufferTextIterator {
+    static constexpr char newline = '\n';
+
+    T const *buffer_ptr;
+    size_t row;
+    size_t col;
+
+  public:
+    using iterator_category = std::bidirectional_iterator_tag;
+    using value_type = char;
+    using difference_type = ptrdiff_t;
+    using pointer = char const *;
+    using reference = char const &;
+
+    BufferTextIterator()
+        : buffer_ptr(nullptr),
+          row(0),
+          col(0) {
+    }
+
+    // clamps to the buffer, since a tree that hasn't caught up with the
+    // latest edits can point past the end of a line
+    BufferTextIterator(T const *bp, TSPoint point)
+        : buffer_ptr(bp),
+          row(std::min((size_t)point.row, bp->num_lines() - 1)),
+          col(std::min((size_t)point.column, bp->at(row).size())) {
+    }
+
+    char const &operator*() const {
+        std::string_view line = buffer_ptr->at(row);
+        return (col == line.size()) ? newline : line[col];
+    }
+
+    BufferTextIterator &operator++() {
+        if (col < buffer_ptr->at(row).size()) {
+            ++col;
+        } else {
+            ++row;
+            col = 0;
+        }
+        return *this;
+    }
+
+    BufferTextIterator operator++(int) {
+        BufferTextIterator to_return = *this;
+        ++*this;
+        return to_return;
+    }
+
+    BufferTextIterator &operator--() {
+        if (col > 0) {
+            --col;
+        } else {
+            col = buffer_ptr->at(--row).size();
+        }
+        return *this;
+    }
+
+    BufferTextIterator operator--(int) {
+        BufferTextIterator to_return = *this;
+        --*this;
+        return to_return;
+    }
+
+    friend bool operator==(BufferTextIterator const &a,
+                           BufferTextIterator const &b) {
+        return a.row == b.row && a.col == b.col;
+    }
+};
+
+// The text predicates (#eq?, #match?, #any-of? and their #not- forms) of a
+// query, parsed once when the query gets compiled. tree-sitter leaves
+// evaluating these to us; predicates we don't know about are ignored.
+class QueryPredicates {
+    enum class Kind { EQ, MATCH, ANY_OF };
+
+    struct Predicate {
+        Kind kind;
+        bool negated;
+        uint32_t capture_id;
+        // #eq? against another capture rather than a string
+        std::optional<uint32_t> other_capture_id;
+        // the string for #eq?, or the options for #any-of?
+        std::vector<std::string> strings;
+        // index into regexes, for #match?
+        size_t regex_idx;
+    };
+
+    // indexed by pattern index; most patterns don't have any
+    std::vector<std::vector<Predicate>> pattern_predicates;
+    // shared between every predicate using the same pattern; nullopt if it
+    // didn't compile, in which case the predicate never matches
+    std::vector<std::optional<std::regex>> regexes;
+
+  public:
+    QueryPredicates() {
+    }
+
+    explicit QueryPredicates(TSQuery const *query) {
+        std::unordered_map<std::string, size_t> regex_indices;
+        auto get_string = [&](TSQueryPredicateStep const &step) {
+            uint32_t length;
+            char const *str =
+                ts_query_string_value_for_id(query, step.value_id, &length);
+            return std::string_view{str, length};
+        };
+
+        uint32_t num_patterns = ts_query_pattern_count(query);
+        pattern_predicates.resize(num_patterns);
+        for (uint32_t pattern_idx = 0; pattern_idx < num_patterns;
+             ++pattern_idx) {
+            uint32_t num_steps;
+            TSQueryPredicateStep const *steps =
+                ts_query_predicates_for_pattern(query, pattern_idx, &num_steps);
+
+            // predicates are runs of steps separated by Done steps, with the
+            // predicate's name first
+            uint32_t start = 0;
+            while (start < num_steps) {
+                uint32_t end = start;
+                while (end < num_steps &&
+                       steps[end].type != TSQueryPredicateStepTypeDone) {
+                    ++end;
+                }
+
+                std::optional<Predicate> maybe_predicate =
+                    parse_predicate(steps + start, end - start, get_string,
+                                    regex_indices);
+                if (maybe_predicate) {
+                    pattern_predicates[pattern_idx].push_back(
+                        std::move(*maybe_predicate));
+                }
+                start = end + 1;
+            }
+        }
+    }
+
+    bool has_predicates(uint32_t pattern_idx) const {
+        return pattern_idx < pattern_predicates.size() &&
+               !pattern_predicates[pattern_idx].empty();
+    }
+
+    // checks the match's text against its pattern's predicates; T is the
+    // buffer the tree was parsed from
+    template <typename T>
+    bool is_satisfied(TSQueryMatch const &match, T const &buffer) const {
+        if (!has_predicates(match.pattern_index)) {
+            return true;
+        }
+
+        using TextIt = BufferTextIterator<T>;
+        auto find_capture = [&](uint32_t capture_id) -> TSNode const * {
+            for (uint16_t idx = 0; idx < match.capture_count; ++idx) {
+                if (match.captures[idx].index == capture_id) {
+                    return &match.captures[idx].node;
+                }
+            }
+            return nullptr;
+        };
+        auto text_begin = [&](TSNode node) {
+            return TextIt{&buffer, ts_node_start_point(node)};
+        };
+        auto text_end = [&](TSNode node) {
+            return TextIt{&buffer, ts_node_end_point(node)};
+        };
+
+        for (Predicate const &predicate :
+             pattern_predicates[match.pattern_index]) {
+            TSNode const *node = find_capture(predicate.capture_id);
+            if (!node) {
+                // quantified captures can match nothing at all
+                continue;
+            }
+
+            bool result = false;
+            switch (predicate.kind) {
+                using enum Kind;
+            case EQ: {
+                if (predicate.other_capture_id) {
+                    TSNode const *other_node =
+                        find_capture(*predicate.other_capture_id);
+                    result = other_node &&
+                             std::equal(text_begin(*node), text_end(*node),
+                                        text_begin(*other_node),
+                                        text_end(*other_node));
+                } else {
+                    std::string const &str = predicate.strings.front();
+                    result = std::equal(text_begin(*node), text_end(*node),
+                                        str.begin(), str.end());
+                }
+            } break;
+            case MATCH: {
+                std::optional<std::regex> const &maybe_regex =
+                    regexes[predicate.regex_idx];
+                result = maybe_regex && std::regex_search(text_begin(*node),
+                                                          text_end(*node),
+                                                          *maybe_regex);
+            } break;
+            case ANY_OF: {
+                result = std::any_of(
+                    predicate.strings.begin(), predicate.strings.end(),
+                    [&](std::string const &str) {
+                        return std::equal(text_begin(*node), text_end(*node),
+                                          str.begin(), str.end());
+                    });
+            } break;
+            }
+
+            if (result == predicate.negated) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+  private:
+    template <typename GetString>
+    std::optional<Predicate>
+    parse_predicate(TSQueryPredicateStep const *steps, uint32_t num_steps,
+                    GetString const &get_string,
+                    std::unordered_map<std::string, size_t> &regex_indices) {
+        // every predicate we handle starts with its name and a capture
+        if (num_steps < 3 || steps[0].type != TSQueryPredicateStepTypeString ||
+            steps[1].type != TSQueryPredicateStepTypeCapture) {
+            return std::nullopt;
+        }
+
+        std::string_view name = get_string(steps[0]);
+        Predicate predicate{.kind = Kind::EQ,
+                            .negated = name.starts_with("not-"),
+                            .capture_id = steps[1].value_id,
+                            .other_capture_id = std::nullopt,
+                            .strings = {},
+                            .regex_idx = 0};
+        if (predicate.negated) {
+            name.remove_prefix(4);
+        }
+
+        if (name == "eq?" && num_steps == 3) {
+            predicate.kind = Kind::EQ;
+            if (steps[2].type == TSQueryPredicateStepTypeCapture) {
+                predicate.other_capture_id = steps[2].value_id;
+            } else {
+                predicate.strings.emplace_back(get_string(steps[2]));
+            }
+            return predicate;
+        }
+
+        if (name == "match?" && num_steps == 3 &&
+            steps[2].type == TSQueryPredicateStepTypeString) {
+            predicate.kind = Kind::MATCH;
+            std::string pattern{get_string(steps[2])};
+            auto [it, inserted] =
+                regex_indices.try_emplace(pattern, regexes.size());
+            if (inserted) {
+                regexes.push_back(compile_regex(pattern));
+            }
+            predicate.regex_idx = it->second;
+            return predicate;
+        }
+
+        if (name == "any-of?") {
+            predicate.kind = Kind::ANY_OF;
+            for (uint32_t idx = 2; idx < num_steps; ++idx) {
+                if (steps[idx].type != TSQueryPredicateStepTypeString) {
+                    return std::nullopt;
+                }
+                predicate.strings.emplace_back(get_string(steps[idx]));
+            }
+            return predicate;
+        }
+
+        return std::nullopt;
+    }
+
+    static std::optional<std::regex> compile_regex(std::string const &pattern) {
+        // std::regex only reports bad patterns by throwing
+        try {
+            return std::regex{pattern, std::regex::ECMAScript |
+                                           std::regex::optimize};
+        } catch (std::regex_error const &) {
+            return std::nullopt;
+        }
+    }
+};
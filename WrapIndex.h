@@ -0,0 +1,218 @@
+#pragma once
+
+#include <assert.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <utility>
+#include <vector>
+
+// How many visual rows every buffer row takes up with soft wrap on, kept in
+// an implicit treap: nodes are ordered by buffer row and carry the sums of
+// their subtrees. Going from a buffer row to its first visual row and back is
+// O(log n), and an edit only replaces the rows it touched, however far down
+// the file it is.
+class WrapIndex {
+    static constexpr uint32_t null_node = 0;
+
+    struct Node {
+        uint32_t left;
+        uint32_t right;
+        uint32_t priority;
+        uint32_t num_rows; // visual rows of this buffer row
+        size_t size;       // buffer rows in the subtree
+        size_t sum;        // visual rows in the subtree
+    };
+
+    // nodes[null_node] stays all zero, so that it adds nothing to sums
+    std::vector<Node> nodes;
+    std::vector<uint32_t> free_nodes;
+    uint32_t root;
+    uint32_t rng_state;
+
+  public:
+    WrapIndex()
+        : nodes(1, Node{}),
+          root(null_node),
+          rng_state(0x9e3779b9) {
+    }
+
+    // buffer rows
+    size_t size() const {
+        return nodes[root].size;
+    }
+
+    // visual rows
+    size_t total_rows() const {
+        return nodes[root].sum;
+    }
+
+    // counts[row] is how many visual rows that row takes up
+    void assign(std::vector<uint32_t> const &counts) {
+        nodes.assign(1, Node{});
+        free_nodes.clear();
+        root = build(counts);
+    }
+
+    // rows [start_row, old_end_row] got replaced by new_counts
+    void replace(size_t start_row, size_t old_end_row,
+                 std::vector<uint32_t> const &new_counts) {
+        assert(start_row <= old_end_row && old_end_row < size());
+        auto [left, rest] = split(root, start_row);
+        auto [middle, right] = split(rest, old_end_row - start_row + 1);
+        free_subtree(middle);
+        root = merge(merge(left, build(new_counts)), right);
+    }
+
+    // the number of visual rows above row
+    size_t rows_before(size_t row) const {
+        size_t sum = 0;
+        uint32_t node = root;
+        while (node != null_node) {
+            Node const &n = nodes[node];
+            size_t left_size = nodes[n.left].size;
+            if (row <= left_size) {
+                node = n.left;
+                continue;
+            }
+            sum += nodes[n.left].sum + n.num_rows;
+            row -= left_size + 1;
+            node = n.right;
+        }
+        return sum;
+    }
+
+    // the buffer row that visual row visual_idx belongs to, and which of
+    // its visual rows it is. Past the end, that's size() and however many
+    // rows too far it went.
+    std::pair<size_t, size_t> row_at(size_t visual_idx) const {
+        size_t row = 0;
+        uint32_t node = root;
+        while (node != null_node) {
+            Node const &n = nodes[node];
+            Node const &left = nodes[n.left];
+            if (visual_idx < left.sum) {
+                node = n.left;
+                continue;
+            }
+            visual_idx -= left.sum;
+            if (visual_idx < n.num_rows) {
+                return {row + left.size, visual_idx};
+            }
+            visual_idx -= n.num_rows;
+            row += left.size + 1;
+            node = n.right;
+        }
+        return {row, visual_idx};
+    }
+
+  private:
+    uint32_t next_priority() {
+        // xorshift32
+        rng_state ^= rng_state << 13;
+        rng_state ^= rng_state >> 17;
+        rng_state ^= rng_state << 5;
+        return rng_state;
+    }
+
+    uint32_t new_node(uint32_t num_rows) {
+        Node node{.left = null_node,
+                  .right = null_node,
+                  .priority = next_priority(),
+                  .num_rows = num_rows,
+                  .size = 1,
+                  .sum = num_rows};
+        if (!free_nodes.empty()) {
+            uint32_t idx = free_nodes.back();
+            free_nodes.pop_back();
+            nodes[idx] = node;
+            return idx;
+        }
+        nodes.push_back(node);
+        return (uint32_t)(nodes.size() - 1);
+    }
+
+    void pull(uint32_t node) {
+        Node &n = nodes[node];
+        n.size = nodes[n.left].size + 1 + nodes[n.right].size;
+        n.sum = nodes[n.left].sum + n.num_rows + nodes[n.right].sum;
+    }
+
+    void pull_subtree(uint32_t node) {
+        if (node == null_node) {
+            return;
+        }
+        pull_subtree(nodes[node].left);
+        pull_subtree(nodes[node].right);
+        pull(node);
+    }
+
+    // a treap over counts in O(n): the usual stack-based Cartesian tree
+    uint32_t build(std::vector<uint32_t> const &counts) {
+        std::vector<uint32_t> spine;
+        for (uint32_t num_rows : counts) {
+            uint32_t node = new_node(num_rows);
+            uint32_t last_popped = null_node;
+            while (!spine.empty() &&
+                   nodes[spine.back()].priority < nodes[node].priority) {
+                last_popped = spine.back();
+                spine.pop_back();
+            }
+            nodes[node].left = last_popped;
+            if (!spine.empty()) {
+                nodes[spine.back()].right = node;
+            }
+            spine.push_back(node);
+        }
+        if (spine.empty()) {
+            return null_node;
+        }
+        pull_subtree(spine.front());
+        return spine.front();
+    }
+
+    void free_subtree(uint32_t node) {
+        if (node == null_node) {
+            return;
+        }
+        free_subtree(nodes[node].left);
+        free_subtree(nodes[node].right);
+        free_nodes.push_back(node);
+    }
+
+    // the first num_rows buffer rows, and the rest
+    std::pair<uint32_t, uint32_t> split(uint32_t node, size_t num_rows) {
+        if (node == null_node) {
+            return {null_node, null_node};
+        }
+        size_t left_size = nodes[nodes[node].left].size;
+        if (num_rows <= left_size) {
+            auto [left, right] = split(nodes[node].left, num_rows);
+            nodes[node].left = right;
+            pull(node);
+            return {left, node};
+        }
+        auto [left, right] =
+            split(nodes[node].right, num_rows - left_size - 1);
+        nodes[node].right = left;
+        pull(node);
+        return {node, right};
+    }
+
+    uint32_t merge(uint32_t a, uint32_t b) {
+        if (a == null_node) {
+            return b;
+        }
+        if (b == null_node) {
+            return a;
+        }
+        if (nodes[a].priority > nodes[b].priority) {
+            nodes[a].right = merge(nodes[a].right, b);
+            pull(a);
+            return a;
+        }
+        nodes[b].left = merge(a, nodes[b].left);
+        pull(b);
+        return b;
+    }
+};
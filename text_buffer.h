@@ -6,6 +6,7 @@
 #include <optional>
 #include <stdlib.h>
 
+#include <algorithm>
 #include <memory>
 #include <string>
 #include <string_view>
@@ -46,182 +47,76 @@ inline size_t var_width_str_into_effective_width(std::string_view sv) {
     return width;
 }
 
-inline std::optional<Cursor> maybe_down_point(std::string_view sv,
-                                              Cursor cursor, size_t width) {
-
-    assert(cursor.col <= sv.size());
-
-    size_t curr_start_effective_col = 0;
-    size_t curr_chunk_width = 0;
-    size_t cumulative_width = 0;
-
-    size_t col = 0;
-    while (col < cursor.col) {
-
-        if (curr_chunk_width + StringUtils::symbol_into_width(sv[col]) <=
-            width) {
-            cumulative_width += StringUtils::symbol_into_width(sv[col]);
-            curr_chunk_width += StringUtils::symbol_into_width(sv[col++]);
-            continue;
-        }
-
-        curr_start_effective_col = cumulative_width;
-        curr_chunk_width = 0;
-    }
-
-    // now we need to first hit the chunk end.
-    std::optional<size_t> next_start_col;
-    std::optional<size_t> next_start_effective_col;
-    while (col < sv.size()) {
-
-        if (curr_chunk_width + StringUtils::symbol_into_width(sv[col]) <=
-            width) {
-            cumulative_width += StringUtils::symbol_into_width(sv[col]);
-            curr_chunk_width += StringUtils::symbol_into_width(sv[col++]);
-        } else {
-            // now that we've hit the good case.
-            next_start_effective_col = cumulative_width;
-            next_start_col = col;
-            break;
-        }
-    }
-
-    if (!next_start_col) {
-        return {};
-    }
-
-    // now same trick as before:
-    // then try to retarget this width if possible.
-    assert(next_start_col);
-    assert(next_start_effective_col);
-
-    size_t width_from_curr = cursor.effective_col - curr_start_effective_col;
-    size_t line_col = *next_start_col;
-    size_t curr_width = 0;
-    while (line_col < sv.size() &&
-           curr_width + StringUtils::symbol_into_width(sv[line_col]) <=
-               width_from_curr) {
-        curr_width += StringUtils::symbol_into_width(sv[line_col++]);
-    }
-
-    return Cursor{cursor.row, line_col, curr_width + *next_start_effective_col};
-}
-
-inline std::optional<Cursor> maybe_up_point(std::string_view sv, Cursor cursor,
-                                            size_t width) {
-    assert(cursor.col <= sv.size());
-
-    size_t prev_start_col = 0;
-    size_t prev_start_effective_col = 0;
-
-    size_t curr_start_col = 0;
-    size_t curr_start_effective_col = 0;
-    size_t curr_chunk_width = 0;
-
-    size_t chunk_idx = 0;
-
-    size_t col = 0;
-    while (col < cursor.col) {
-        if (curr_chunk_width + StringUtils::symbol_into_width(sv[col]) <=
-            width) {
-            curr_chunk_width += StringUtils::symbol_into_width(sv[col++]);
-            continue;
-        }
-
-        prev_start_col = curr_start_col;
-        prev_start_effective_col = curr_start_effective_col;
-
-        curr_start_col = col;
-        curr_start_effective_col = curr_chunk_width + prev_start_effective_col;
-        curr_chunk_width = 0;
-        ++chunk_idx;
-    }
-
-    if (chunk_idx == 0) {
-        return {};
-    }
-
-    // then try to retarget this width if possible.
-    size_t width_from_curr = cursor.effective_col - curr_start_effective_col;
-    size_t line_col = prev_start_col;
-    size_t curr_width = 0;
-    while (line_col < curr_start_col &&
-           curr_width + StringUtils::symbol_into_width(sv[line_col]) <=
-               width_from_curr) {
-        curr_width += StringUtils::symbol_into_width(sv[line_col++]);
-    }
-
-    return Cursor{cursor.row, line_col, curr_width + prev_start_effective_col};
-}
-
 // returns the indices into the string that start at chunks divided by width
-// in a left justified manner
+// in a left justified manner, along with the effective column each one
+// starts at. With at_words, chunks end after the last space or tab that fits
+// where there is one, so words don't get split across rows.
 inline std::vector<std::pair<size_t, size_t>>
-columns_of_chunked_text(std::string_view sv, size_t width) {
+columns_of_chunked_text(std::string_view sv, size_t width,
+                        bool at_words = false) {
     assert(width > 0); // eventually set this to tab_stop or something
     std::vector<std::pair<size_t, size_t>> starting_indices = {{0, 0}};
     size_t sv_idx = 0;
     size_t cumulative_width = 0;
     size_t curr_chunk_width = 0;
+    // the latest place in the current chunk that comes right after a space
+    std::optional<std::pair<size_t, size_t>> maybe_word_break;
 
     while (sv_idx < sv.size()) {
         if (curr_chunk_width + symbol_into_width(sv[sv_idx]) <= width) {
             curr_chunk_width += symbol_into_width(sv[sv_idx]);
             cumulative_width += symbol_into_width(sv[sv_idx]);
             ++sv_idx;
+            if (at_words && (sv[sv_idx - 1] == ' ' || sv[sv_idx - 1] == '\t')) {
+                maybe_word_break = {sv_idx, cumulative_width};
+            }
+        } else if (maybe_word_break && maybe_word_break->first < sv_idx) {
+            // whatever's past the break moves down with the word
+            starting_indices.push_back(*maybe_word_break);
+            curr_chunk_width = cumulative_width - maybe_word_break->second;
+            maybe_word_break.reset();
         } else {
             starting_indices.push_back({sv_idx, cumulative_width});
             curr_chunk_width = 0;
+            maybe_word_break.reset();
         }
     }
 
     return starting_indices;
 }
 
-inline Cursor first_chunk(std::string_view sv, Cursor cursor,
-                          [[maybe_unused]] size_t width) {
-    size_t col = 0, effective_width = 0;
-    while (col < sv.size() && effective_width <= cursor.effective_col) {
-        if (effective_width + StringUtils::symbol_into_width(sv[col]) >
-            cursor.effective_col) {
-            break;
-        }
-
-        effective_width += StringUtils::symbol_into_width(sv[col++]);
-    }
-    return Cursor{cursor.row, col, effective_width};
+// which of the chunks (see columns_of_chunked_text) col is on; a col right
+// at the start of a chunk is on that chunk
+inline size_t
+chunk_of_col(std::vector<std::pair<size_t, size_t>> const &chunk_starts,
+             size_t col) {
+    assert(!chunk_starts.empty());
+    auto it = std::upper_bound(
+        chunk_starts.begin() + 1, chunk_starts.end(), col,
+        [](size_t c, std::pair<size_t, size_t> const &start) {
+            return c < start.first;
+        });
+    return (size_t)(it - chunk_starts.begin()) - 1;
 }
 
-inline Cursor final_chunk(std::string_view sv, Cursor cursor, size_t width) {
-    auto points = StringUtils::columns_of_chunked_text(sv, width);
-    assert(!points.empty());
-
-    if (points.size() == 1) {
-        // then it's just the final point.
-        assert(points.front().first == 0 && points.front().second == 0);
-        size_t col = 0, effective_width = 0;
-        while (col < sv.size() && effective_width <= cursor.effective_col) {
-            if (effective_width + StringUtils::symbol_into_width(sv[col]) >
-                cursor.effective_col) {
-                break;
-            }
-            effective_width += StringUtils::symbol_into_width(sv[col++]);
-        }
-        return Cursor{cursor.row, col, effective_width};
-    }
-
-    size_t second_last_idx = points.size() - 2;
-    size_t effective_offset = cursor.effective_col - points.back().second;
+// the point in chunk chunk_idx of sv (on row row) that's closest to being
+// effective_offset columns in, without going past it
+inline Cursor
+point_in_chunk(std::string_view sv, size_t row,
+               std::vector<std::pair<size_t, size_t>> const &chunk_starts,
+               size_t chunk_idx, size_t effective_offset) {
+    auto [col, effective_col] = chunk_starts[chunk_idx];
+    // the start of the next chunk is drawn on the next row, so only the
+    // last chunk gets to include its end
+    size_t last_col = (chunk_idx + 1 < chunk_starts.size())
+                          ? chunk_starts[chunk_idx + 1].first - 1
+                          : sv.size();
     size_t curr_width = 0;
-    size_t curr_col = points[second_last_idx].first;
-    while (curr_col < cursor.col) {
-        if (curr_width + StringUtils::symbol_into_width(sv[curr_col]) >
-            effective_offset) {
-            break;
-        }
-        curr_width += StringUtils::symbol_into_width(sv[curr_col++]);
+    while (col < last_col &&
+           curr_width + symbol_into_width(sv[col]) <= effective_offset) {
+        curr_width += symbol_into_width(sv[col++]);
     }
-    return Cursor{cursor.row, curr_col, curr_width + cursor.effective_col};
+    return Cursor{row, col, effective_col + curr_width};
 }
 
 } // namespace StringUtils
@@ -325,6 +220,20 @@ class LineSizeTree {
         }
     }
 
+    // deep copies; we need these to hand buffer snapshots to the parser
+    LineSizeTree(LineSizeTree const &other)
+        : root_node(clone(other.root_node)) {
+    }
+
+    LineSizeTree(LineSizeTree &&other)
+        : root_node(std::exchange(other.root_node, nullptr)) {
+    }
+
+    LineSizeTree &operator=(LineSizeTree other) {
+        std::swap(root_node, other.root_node);
+        return *this;
+    }
+
     void clear() {
         assert(root_node);
         delete root_node;
@@ -443,6 +352,19 @@ class LineSizeTree {
     }
 
   private:
+    static Node *clone(Node const *c_node) {
+        if (!c_node) {
+            return nullptr;
+        }
+
+        Node *to_return =
+            new Node(c_node->line_size, c_node->tree_size, c_node->priority);
+        to_return->total_line_size = c_node->total_line_size;
+        to_return->left_node = clone(c_node->left_node);
+        to_return->right_node = clone(c_node->right_node);
+        return to_return;
+    }
+
     static Node *get_node_at_position(Node *c_node, size_t position) {
         assert(c_node);
         if (c_node->left_size() == position) {
@@ -592,7 +514,12 @@ class LineSizeTree {
     }
 };
 
+struct TextBufferReader;
+
 struct TextBuffer {
+    // what the parser should use to read from snapshots of us
+    using Reader = TextBufferReader;
+
     std::vector<std::string> buffer;
     LineSizeTree starting_byte_offset;
 
@@ -634,7 +561,22 @@ struct TextBuffer {
         }
     }
 
-    size_t actual_line_size(size_t row) {
+    // copy of rows [first_row, end_row) as a buffer of its own; the last
+    // row loses its newline
+    TextBuffer slice(size_t first_row, size_t end_row) const {
+        assert(first_row < end_row && end_row <= buffer.size());
+        TextBuffer to_return;
+        to_return.buffer.assign(buffer.begin() + (long)first_row,
+                                buffer.begin() + (long)end_row);
+        to_return.starting_byte_offset.clear();
+        for (size_t idx = 0; idx < to_return.buffer.size(); ++idx) {
+            to_return.starting_byte_offset.insert_before_position(
+                idx, to_return.actual_line_size(idx));
+        }
+        return to_return;
+    }
+
+    size_t actual_line_size(size_t row) const {
         assert(row < buffer.size());
         if (row == buffer.size() - 1) {
             return buffer[row].size();
@@ -886,46 +828,105 @@ struct TextBuffer {
     }
 };
 
+// Keeps track of where the last read landed, so that tree-sitter's mostly
+// sequential reads don't each need two walks down the LineSizeTree.
+struct TextBufferReader {
+    // short lines get stitched together (newlines included) into chunks of
+    // about this size, so we aren't called back once per line and newline
+    static constexpr size_t read_chunk_size = 4096;
+    // forward jumps shorter than this many lines are walked instead of
+    // looked up in the tree
+    static constexpr size_t max_lines_to_walk = 8;
+
+    TextBuffer const *text_buffer_ptr;
+    // where the buffer starts in the document being parsed; non-zero when
+    // we only hold a slice of it
+    size_t base_offset;
+    size_t line_idx;          // line containing the last read
+    size_t line_start_offset; // byte offset at the start of line_idx
+    std::string chunk;        // scratch space for stitched lines
+
+    TextBufferReader(TextBuffer const *tbp, size_t bo = 0)
+        : text_buffer_ptr(tbp),
+          base_offset(bo),
+          line_idx(0),
+          line_start_offset(0) {
+    }
+
+    // moves the cursor onto the line containing byte_offset
+    void seek(size_t byte_offset) {
+        size_t num_lines = text_buffer_ptr->num_lines();
+        for (size_t steps = 0;
+             steps < max_lines_to_walk && line_start_offset <= byte_offset;
+             ++steps) {
+            size_t line_size = text_buffer_ptr->actual_line_size(line_idx);
+            if (byte_offset < line_start_offset + line_size ||
+                line_idx + 1 == num_lines) {
+                return;
+            }
+            line_start_offset += line_size;
+            ++line_idx;
+        }
+
+        // too far away (or behind us), fall back to the tree
+        line_idx =
+            text_buffer_ptr->starting_byte_offset.line_containing_offset(
+                byte_offset);
+        line_start_offset =
+            text_buffer_ptr->starting_byte_offset.byte_offset_at_line(
+                line_idx);
+    }
+};
+
 inline const char *read_text_buffer(void *payload, uint32_t byte_offset,
                                     [[maybe_unused]] TSPoint position,
                                     uint32_t *bytes_read) {
-    TextBuffer *text_buffer_ptr = (TextBuffer *)payload;
+    TextBufferReader *reader = (TextBufferReader *)payload;
+    TextBuffer const *text_buffer_ptr = reader->text_buffer_ptr;
 
-    if (byte_offset == text_buffer_ptr->total_bytes()) {
+    // offsets are relative to the whole document, not just our slice
+    if (byte_offset < reader->base_offset ||
+        byte_offset - reader->base_offset >= text_buffer_ptr->total_bytes()) {
         *bytes_read = 0;
         return "\0";
     }
+    byte_offset -= (uint32_t)reader->base_offset;
 
-    size_t line_idx =
-        text_buffer_ptr->starting_byte_offset.line_containing_offset(
-            byte_offset);
+    reader->seek(byte_offset);
+    assert(reader->line_start_offset <= byte_offset);
 
-    assert(line_idx <= text_buffer_ptr->num_lines());
+    size_t num_lines = text_buffer_ptr->num_lines();
+    std::string_view line = text_buffer_ptr->at(reader->line_idx);
+    size_t line_offset = (size_t)(byte_offset - reader->line_start_offset);
+    assert(line_offset <= line.size());
 
-    if (line_idx == text_buffer_ptr->num_lines()) {
-        *bytes_read = 0;
-        return "\0";
+    // the last line has no newline, and long lines are worth handing out
+    // in place rather than copying
+    if (reader->line_idx + 1 == num_lines ||
+        line.size() - line_offset >= TextBufferReader::read_chunk_size) {
+        *bytes_read = (uint32_t)(line.size() - line_offset);
+        return line.data() + line_offset;
     }
 
-    // get the byte offset at that line as well
-    size_t line_start_offset =
-        text_buffer_ptr->starting_byte_offset.byte_offset_at_line(line_idx);
-
-    assert(line_start_offset <= byte_offset);
-    size_t line_offset = (size_t)(byte_offset - line_start_offset);
-    assert(line_offset <= text_buffer_ptr->at(line_idx).size());
+    // otherwise stitch as many whole lines after it as fit into one chunk
+    reader->chunk.assign(line.substr(line_offset));
+    reader->chunk.push_back('\n');
+    while (reader->line_idx + 1 < num_lines) {
+        std::string_view next_line = text_buffer_ptr->at(reader->line_idx + 1);
+        if (reader->chunk.size() + next_line.size() + 1 >
+            TextBufferReader::read_chunk_size) {
+            break;
+        }
 
-    if (line_offset == text_buffer_ptr->at(line_idx).size()) {
-        if (line_idx < text_buffer_ptr->num_lines() - 1) {
-            *bytes_read = 1;
-            return "\n";
-        } else {
-            *bytes_read = 0;
-            return "\0";
+        reader->line_start_offset +=
+            text_buffer_ptr->actual_line_size(reader->line_idx);
+        ++reader->line_idx;
+        reader->chunk.append(next_line);
+        if (reader->line_idx + 1 < num_lines) {
+            reader->chunk.push_back('\n');
         }
-    } else {
-        *bytes_read =
-            (uint32_t)(text_buffer_ptr->at(line_idx).size() - line_offset);
-        return text_buffer_ptr->at(line_idx).data() + line_offset;
     }
+
+    *bytes_read = (uint32_t)reader->chunk.size();
+    return reader->chunk.data();
 }
@@ -2,18 +2,30 @@
 
 #include <stddef.h>
 
-#include <dlfcn.h>
-
+#include <algorithm>
+#include <atomic>
 #include <compare>
+#include <condition_variable>
+#include <functional>
 #include <iostream>
+#include <memory>
+#include <mutex>
 #include <optional>
+#include <thread>
+#include <vector>
 
 // #include "tree_sitter/include/tree_sitter/api.h"
 #include <string_view>
 #include <tree_sitter/api.h>
 // #include "tree_sitter/languages/languages.h"
 
+#include "EditorConfig.h"
+#include "ErrorIndex.h"
 #include "File.h"
+#include "Folds.h"
+#include "GrammarRegistry.h"
+#include "HighlightCache.h"
+#include "Highlighter.h"
 
 struct Point {
 
@@ -100,52 +112,174 @@ struct Cursor {
     }
 };
 
-typedef TSLanguage *(*parser_fn_ptr_t)(void);
+// buffer reader function type for tree-sitter
+typedef const char *(*read_fn_ptr_t)(void *, uint32_t, TSPoint, uint32_t *);
+
+// Owns the TSParser and runs ts_parser_parse on its own thread so that
+// typing never waits on a parse. Each job carries its own copy of the buffer
+// (and of the old tree), so the worker never touches state owned by the UI
+// thread. That copy is made on the UI thread, so Parser keeps it small; see
+// Parser::submit_snapshot. Only the latest job matters: submitting a new one
+// cancels whatever is currently being parsed.
+template <typename T> class ParseWorker {
+
+  public:
+    struct FinishedTree {
+        TSTree *tree;
+        uint64_t generation;
+        // the part of the buffer the tree covers; nullopt for all of it
+        std::optional<TSRange> included_range;
+    };
+
+  private:
+    struct Job {
+        TSLanguage const *language;
+        TSTree *old_tree; // owned by the job, may be nullptr for fresh parses
+        // when set, snapshot only holds the lines of this range, and the
+        // parse is restricted to it
+        T snapshot;
+        std::optional<TSRange> included_range;
+        uint64_t generation;
+    };
+
+    // safeguard so that a pathological input can't pin the worker forever
+    static constexpr uint64_t parse_timeout_micros = 5'000'000;
+
+    TSParser *parser_ptr;
+    read_fn_ptr_t read_function_ptr;
+    std::function<void()> on_tree_ready;
+
+    std::mutex mtx;
+    std::condition_variable cv;
+    std::optional<Job> pending_job;
+    std::optional<FinishedTree> finished_tree;
+    // tree-sitter polls this between parse steps; non-zero means give up
+    std::atomic<size_t> cancellation_flag;
+    bool stopping;
 
-// RAII-based wrapper for dynamically linked functions
-struct DLFunc {
-    std::string symbol_name; // file name of where the shared library is
-    void *handle;            // the handle returned by dlopen
-    parser_fn_ptr_t fn_ptr;
+    std::thread worker_thread;
 
-    std::string errmsg;
-    DLFunc(std::string_view filename, std::string_view s_name)
-        : symbol_name(s_name),
-          handle(nullptr) {
-        // do a dl open here
-        handle = dlopen(filename.data(), RTLD_LAZY);
-        // need to handle the errors gracefully (maybe eventually with logging?)
-        if (!handle) { // if the handle is missing what do we do?
-            errmsg = dlerror();
+  public:
+    ParseWorker(read_fn_ptr_t rfp, std::function<void()> otr)
+        : parser_ptr(ts_parser_new()),
+          read_function_ptr(rfp),
+          on_tree_ready(std::move(otr)),
+          cancellation_flag(0),
+          stopping(false) {
+        ts_parser_set_timeout_micros(parser_ptr, parse_timeout_micros);
+        ts_parser_set_cancellation_flag(
+            parser_ptr, reinterpret_cast<size_t const *>(&cancellation_flag));
+        worker_thread = std::thread(&ParseWorker::run, this);
+    }
+
+    ~ParseWorker() {
+        {
+            std::lock_guard lock{mtx};
+            stopping = true;
+            cancellation_flag = 1;
         }
+        cv.notify_one();
+        worker_thread.join();
 
-        fn_ptr = (::parser_fn_ptr_t)dlsym(handle, symbol_name.c_str());
+        if (pending_job && pending_job->old_tree) {
+            ts_tree_delete(pending_job->old_tree);
+        }
+        if (finished_tree) {
+            ts_tree_delete(finished_tree->tree);
+        }
+        ts_parser_delete(parser_ptr);
     }
 
-    DLFunc(DLFunc const &) = delete;
-    DLFunc(DLFunc &&) = delete;
-    DLFunc &operator=(DLFunc const &) = delete;
-    DLFunc &operator=(DLFunc &&) = delete;
+    ParseWorker(ParseWorker const &) = delete;
+    ParseWorker(ParseWorker &&) = delete;
+    ParseWorker &operator=(ParseWorker const &) = delete;
+    ParseWorker &operator=(ParseWorker &&) = delete;
 
-    ~DLFunc() {
-        if (handle) {
-            dlclose(handle);
+    // takes ownership of old_tree
+    void submit(TSLanguage const *language, TSTree *old_tree, T snapshot,
+                std::optional<TSRange> included_range, uint64_t generation) {
+        {
+            std::lock_guard lock{mtx};
+            if (pending_job && pending_job->old_tree) {
+                ts_tree_delete(pending_job->old_tree);
+            }
+            pending_job = Job{.language = language,
+                              .old_tree = old_tree,
+                              .snapshot = std::move(snapshot),
+                              .included_range = included_range,
+                              .generation = generation};
+            // a newer edit makes whatever is in flight useless
+            cancellation_flag = 1;
         }
+        cv.notify_one();
     }
 
-    ::parser_fn_ptr_t get_parser_fn_ptr() {
-        return fn_ptr;
+    // hands over the most recently completed tree (if any) to the caller
+    std::optional<FinishedTree> take_finished_tree() {
+        std::lock_guard lock{mtx};
+        return std::exchange(finished_tree, std::nullopt);
     }
-};
 
-struct Capture {
-    Point start;
-    Point end;
-    std::string_view capture_name;
-};
+  private:
+    void run() {
+        while (true) {
+            std::optional<Job> job;
+            {
+                std::unique_lock lock{mtx};
+                cv.wait(lock, [this]() { return stopping || pending_job; });
+                if (stopping) {
+                    return;
+                }
+                job = std::exchange(pending_job, std::nullopt);
+                cancellation_flag = 0;
+            }
 
-// buffer reader function type for tree-sitter
-typedef const char *(*read_fn_ptr_t)(void *, uint32_t, TSPoint, uint32_t *);
+            if (ts_parser_language(parser_ptr) != job->language) {
+                ts_parser_set_language(parser_ptr, job->language);
+            }
+
+            size_t base_offset = 0;
+            if (job->included_range) {
+                ts_parser_set_included_ranges(parser_ptr,
+                                              &*job->included_range, 1);
+                base_offset = job->included_range->start_byte;
+            } else {
+                // back to parsing the whole document
+                ts_parser_set_included_ranges(parser_ptr, nullptr, 0);
+            }
+
+            typename T::Reader reader{&job->snapshot, base_offset};
+            TSTree *new_tree = ts_parser_parse(
+                parser_ptr, job->old_tree,
+                TSInput{.payload = (void *)&reader,
+                        .read = read_function_ptr,
+                        .encoding = TSInputEncodingUTF8});
+
+            if (job->old_tree) {
+                ts_tree_delete(job->old_tree);
+            }
+
+            if (!new_tree) {
+                // either cancelled or timed out; start the next job afresh
+                ts_parser_reset(parser_ptr);
+                continue;
+            }
+
+            {
+                std::lock_guard lock{mtx};
+                if (finished_tree) {
+                    // nobody picked up the previous one, it's stale now
+                    ts_tree_delete(finished_tree->tree);
+                }
+                finished_tree = FinishedTree{.tree = new_tree,
+                                             .generation = job->generation,
+                                             .included_range =
+                                                 job->included_range};
+            }
+            on_tree_ready();
+        }
+    }
+};
 
 // Container for TSParser, and TSTree
 // Considering that both are stateful they seem coupled.
@@ -153,123 +287,137 @@ typedef const char *(*read_fn_ptr_t)(void *, uint32_t, TSPoint, uint32_t *);
 // instance of a file we wish to parse
 template <typename T> class Parser {
 
-  public:
-    // For now let's just run with these
-    enum class LANG {
-        C,
-        CPP,
-        PYTHON,
-        JSON,
+    // what a snapshot costs per line on top of the text: the std::string
+    // and the LineSizeTree node that get copied along with it
+    static constexpr size_t snapshot_bytes_per_line = 64;
+    // how many rows above and below the viewport the window covers
+    static constexpr size_t window_margin_rows = 2000;
+
+    // [first, end) rows of the buffer
+    using RowRange = std::pair<size_t, size_t>;
+
+    // the enclosing scopes of the last row asked about, good for as long as
+    // the tree stays the same
+    struct ScopeCache {
+        size_t row = std::string::npos;
+        uint64_t tree_version = 0;
+        std::vector<size_t> header_rows;
     };
 
   private:
-    // should we just make a static table for all the dlsyms?
-
-    TSParser *parser_ptr; // pointer to the stateful parser
-    TSTree *tree_ptr;     // pointer to the result of the parser
-    std::optional<LANG> language;
-    std::string query_str;
+    // the actual parsing happens on the worker's thread
+    std::unique_ptr<ParseWorker<T>> worker_ptr;
+    TSTree *tree_ptr; // last completed tree, kept edited to match the buffer
+    // owned by the GrammarRegistry, and shared with every other buffer in
+    // the same language (along with its compiled query)
+    Grammar const *grammar_ptr;
     T const *buffer_ptr; // pointer to the buffer we want to parse
-    read_fn_ptr_t read_function_ptr;
-    // just so happens you need it again when forming queries
-    parser_fn_ptr_t parser_function_ptr;
-
-  public:
-    static std::string_view get_queries_str(LANG lang) {
-        switch (lang) {
-            using enum LANG;
-        case PYTHON: {
-            return "";
-        } break;
-        case CPP: {
-            static File cpp_queries_file{
-                "tree_sitter_langs/cpp/highlights.scm"};
-            static std::string cpp_query_string =
-                cpp_queries_file.get_file_contents().value();
-            return cpp_query_string;
-        }
-        case C: {
-            return "";
-        }
-        default:
-            break;
-        }
 
-        return "";
-    }
-
-    static parser_fn_ptr_t get_parser_ptr(LANG lang) {
-        switch (lang) {
-            using enum LANG;
-        case PYTHON: {
-            static DLFunc python_dl{"tree_sitter_langs/python/python.so",
-                                    "tree_sitter_python"};
-            return python_dl.get_parser_fn_ptr();
-        } break;
-        case CPP: {
-            static DLFunc cpp_dl{"tree_sitter_langs/cpp/cpp.so",
-                                 "tree_sitter_cpp"};
-            return cpp_dl.get_parser_fn_ptr();
-        }
-        case C: {
-            static DLFunc cpp_dl{"tree_sitter_langs/c/c.so", "tree_sitter_c"};
-            return cpp_dl.get_parser_fn_ptr();
-        }
-        default:
-            break;
-        }
-
-        return nullptr;
-    }
+    // bumped on every snapshot we hand to the worker; trees coming back
+    // from the worker are tagged with the generation they were parsed from
+    uint64_t generation;
+    uint64_t tree_generation;
+    // bumped whenever tree_ptr changes, be it a new tree or an edit to it
+    uint64_t tree_version;
+    // edits not yet reflected in any tree that came back from the worker,
+    // tagged with the generation of the snapshot that will first contain them
+    std::vector<std::pair<uint64_t, TSInputEdit>> unparsed_edits;
+    // true if there are edits since the last snapshot we submitted
+    bool has_pending_edits;
+
+    // large files only: the rows we want parsed, and the rows the current
+    // tree was parsed over. nullopt means the whole buffer.
+    std::optional<RowRange> window_rows;
+    std::optional<RowRange> tree_rows;
+    // the window moved since the last snapshot we submitted
+    bool needs_reanchor;
+
+    // filled lazily by the renderer, hence mutable
+    mutable HighlightCache highlight_cache;
+    // references resolved through the grammar's locals query
+    LocalsIndex locals_index;
+    // where the ERROR and MISSING nodes are
+    ErrorIndex error_index;
+    // for the sticky header, which asks every frame
+    mutable ScopeCache scope_cache;
 
-    parser_fn_ptr_t get_current_language_parser_ptr() {
-        assert(language.value());
-        assert(parser_function_ptr);
-        return parser_function_ptr;
+  public:
+    // the grammar must already be loaded; see Grammar::load()
+    void set_grammar(Grammar const *gp) {
+        assert(gp && gp->is_loaded());
+        grammar_ptr = gp;
     }
 
-    void set_language(LANG lang) {
-        language = lang;
-        parser_function_ptr = get_parser_ptr(language.value());
-        ts_parser_set_language(parser_ptr, parser_function_ptr());
+    Grammar const *get_grammar() const {
+        return grammar_ptr;
     }
 
-    Parser(T const *bp, read_fn_ptr_t rfp)
-        : parser_ptr(ts_parser_new()),
+    // on_tree_ready gets called from the worker thread whenever a parse
+    // completes; it should only nudge the UI thread to call poll_tree()
+    Parser(T const *bp, read_fn_ptr_t rfp, std::function<void()> on_tree_ready)
+        : worker_ptr(
+              std::make_unique<ParseWorker<T>>(rfp, std::move(on_tree_ready))),
           tree_ptr(nullptr),
-          language(std::nullopt),
+          grammar_ptr(nullptr),
           buffer_ptr(bp),
-          read_function_ptr(rfp) {
+          generation(0),
+          tree_generation(0),
+          tree_version(0),
+          has_pending_edits(false),
+          window_rows(std::nullopt),
+          tree_rows(std::nullopt),
+          needs_reanchor(false) {
     }
 
     ~Parser() {
+        // stop the worker first so nothing comes back after the tree is gone
+        worker_ptr.reset();
+
         if (tree_ptr) {
             ts_tree_delete(tree_ptr);
         }
-
-        if (parser_ptr) {
-            ts_parser_delete(parser_ptr);
-        }
     }
 
     friend void swap(Parser &a, Parser &b) {
         using std::swap;
-        swap(a.parser_ptr, b.parser_ptr);
+        swap(a.worker_ptr, b.worker_ptr);
         swap(a.tree_ptr, b.tree_ptr);
-        swap(a.language, b.language);
+        swap(a.grammar_ptr, b.grammar_ptr);
         swap(a.buffer_ptr, b.buffer_ptr);
-        swap(a.read_function_ptr, b.read_function_ptr);
+        swap(a.generation, b.generation);
+        swap(a.tree_generation, b.tree_generation);
+        swap(a.tree_version, b.tree_version);
+        swap(a.unparsed_edits, b.unparsed_edits);
+        swap(a.has_pending_edits, b.has_pending_edits);
+        swap(a.window_rows, b.window_rows);
+        swap(a.tree_rows, b.tree_rows);
+        swap(a.needs_reanchor, b.needs_reanchor);
+        swap(a.highlight_cache, b.highlight_cache);
+        swap(a.locals_index, b.locals_index);
+        swap(a.error_index, b.error_index);
+        swap(a.scope_cache, b.scope_cache);
     }
 
     Parser(Parser const &) = delete;
     Parser &operator=(Parser const &) = delete;
 
     Parser(Parser &&other)
-        : parser_ptr(std::exchange(other.parser_ptr, nullptr)),
+        : worker_ptr(std::move(other.worker_ptr)),
           tree_ptr(std::exchange(other.tree_ptr, nullptr)),
-          language(other.language),
+          grammar_ptr(other.grammar_ptr),
           buffer_ptr(other.buffer_ptr),
-          read_function_ptr(other.read_function_ptr) {
+          generation(other.generation),
+          tree_generation(other.tree_generation),
+          tree_version(other.tree_version),
+          unparsed_edits(std::move(other.unparsed_edits)),
+          has_pending_edits(other.has_pending_edits),
+          window_rows(other.window_rows),
+          tree_rows(other.tree_rows),
+          needs_reanchor(other.needs_reanchor),
+          highlight_cache(std::move(other.highlight_cache)),
+          locals_index(std::move(other.locals_index)),
+          error_index(std::move(other.error_index)),
+          scope_cache(std::move(other.scope_cache)) {
     }
     Parser &operator=(Parser &&other) {
         Parser temp{std::move(other)};
@@ -279,20 +427,75 @@ template <typename T> class Parser {
 
     // IMPT: use this for fresh parses and not updates
     void parse_buffer() {
-        assert(language.has_value());
-        tree_ptr = ts_parser_parse(parser_ptr, nullptr,
-                                   TSInput{.payload = (void *)buffer_ptr,
-                                           .read = read_function_ptr,
-                                           .encoding = TSInputEncodingUTF8});
-        // according to the api docs, it should never return nullptr (based on
-        // how we are using it)
-        assert(tree_ptr);
+        assert(grammar_ptr);
+        if (tree_ptr) {
+            ts_tree_delete(tree_ptr);
+            tree_ptr = nullptr;
+        }
+        ++tree_version;
+        unparsed_edits.clear();
+        has_pending_edits = false;
+        needs_reanchor = false;
+        highlight_cache.reset(buffer_ptr->num_lines());
+        locals_index.reset();
+        error_index.reset();
+        // whatever the worker was busy with is for an outdated buffer
+        tree_generation = generation++;
+        if (!is_large_file()) {
+            window_rows.reset();
+        } else if (!window_rows) {
+            // we haven't been told where the viewport is yet
+            window_rows = RowRange{0, 2 * window_margin_rows};
+        }
+        submit_snapshot(nullptr, generation);
+    }
+
+    // roughly how many bytes a snapshot of the whole buffer copies
+    size_t snapshot_bytes() const {
+        return buffer_ptr->total_bytes() +
+               buffer_ptr->num_lines() * snapshot_bytes_per_line;
+    }
+
+    // a buffer is large once copying all of it for every parse costs more
+    // than the config allows; see EditorConfig::parse_window_bytes
+    bool is_large_file() const {
+        return snapshot_bytes() > EditorConfig::get().parse_window_bytes;
     }
 
+    // tells the parser which rows are on screen (inclusive); for large files
+    // this re-anchors the parse window once the viewport nears its edge.
+    // Call this before flush_edits().
+    void set_viewport(size_t first_row, size_t last_row) {
+        if (!is_large_file()) {
+            if (window_rows) {
+                // shrank under the threshold, go back to full parses
+                window_rows.reset();
+                needs_reanchor = true;
+            }
+            return;
+        }
+
+        size_t num_lines = buffer_ptr->num_lines();
+        size_t slack = window_margin_rows / 4;
+        if (window_rows &&
+            (window_rows->first == 0 ||
+             first_row >= window_rows->first + slack) &&
+            (window_rows->second >= num_lines ||
+             last_row + slack < window_rows->second)) {
+            return;
+        }
+
+        window_rows =
+            RowRange{first_row - std::min(first_row, window_margin_rows),
+                     std::min(num_lines, last_row + 1 + window_margin_rows)};
+        needs_reanchor = true;
+    }
+
+    // Only records the edit; nothing gets parsed until flush_edits(). That
+    // way a burst of keystrokes between two frames costs a single parse.
     void update(Point start_point, Point old_end_point, Point new_end_point,
                 size_t start_byte, size_t old_end_byte, size_t new_end_byte) {
-        assert(language.has_value());
-        assert(tree_ptr);
+        assert(grammar_ptr);
 
         TSInputEdit edit{.start_byte = (uint32_t)start_byte,
                          .old_end_byte = (uint32_t)old_end_byte,
@@ -301,12 +504,101 @@ template <typename T> class Parser {
                          .old_end_point = old_end_point,
                          .new_end_point = new_end_point};
 
-        ts_tree_edit(tree_ptr, &edit);
-        tree_ptr = ts_parser_parse(parser_ptr, tree_ptr,
-                                   TSInput{.payload = (void *)buffer_ptr,
-                                           .read = read_function_ptr,
-                                           .encoding = TSInputEncodingUTF8});
-        // TODO: i think we need to invalidate the queries
+        unparsed_edits.push_back({generation + 1, edit});
+        has_pending_edits = true;
+
+        // keep the tree we render with lined up with the buffer until the
+        // worker gives us a fresh one
+        if (tree_ptr) {
+            ts_tree_edit(tree_ptr, &edit);
+            ++tree_version;
+        }
+        highlight_cache.apply_edit(edit);
+        locals_index.apply_edit(edit);
+        error_index.apply_edit(edit);
+    }
+
+    // hands the accumulated edits to the worker as a single parse; call this
+    // once per frame, right before rendering
+    void flush_edits() {
+        if (!has_pending_edits && !needs_reanchor) {
+            return;
+        }
+
+        // the tree has already been through every ts_tree_edit in sequence.
+        // A window that moved shares little with the old tree, so don't
+        // bother reusing it then.
+        TSTree *old_tree =
+            (tree_ptr && !needs_reanchor) ? ts_tree_copy(tree_ptr) : nullptr;
+        has_pending_edits = false;
+        needs_reanchor = false;
+        submit_snapshot(old_tree, ++generation);
+    }
+
+    // call this from the UI thread; returns true if we picked up a new tree
+    bool poll_tree() {
+        auto maybe_finished = worker_ptr->take_finished_tree();
+        if (!maybe_finished) {
+            return false;
+        }
+
+        auto [new_tree, new_tree_generation, new_tree_range] = *maybe_finished;
+        if (new_tree_generation <= tree_generation) {
+            ts_tree_delete(new_tree);
+            return false;
+        }
+
+        // anything typed after the snapshot was taken still has to be
+        // applied on top of the new tree
+        std::erase_if(unparsed_edits, [&](auto const &gen_edit) {
+            return gen_edit.first <= new_tree_generation;
+        });
+        for (auto const &[gen, edit] : unparsed_edits) {
+            ts_tree_edit(new_tree, &edit);
+        }
+
+        if (tree_ptr) {
+            // only the lines whose syntax actually changed need requerying
+            uint32_t num_ranges;
+            TSRange *changed_ranges =
+                ts_tree_get_changed_ranges(tree_ptr, new_tree, &num_ranges);
+            highlight_cache.invalidate_ranges(changed_ranges, num_ranges);
+            for (uint32_t idx = 0; idx < num_ranges; ++idx) {
+                locals_index.mark_dirty(changed_ranges[idx].start_point.row,
+                                        changed_ranges[idx].end_point.row);
+                error_index.mark_dirty(changed_ranges[idx].start_point.row,
+                                       changed_ranges[idx].end_point.row);
+            }
+            free(changed_ranges);
+            highlight_cache.invalidate_provisional();
+
+            // rows that moved in or out of the window change regardless
+            std::optional<RowRange> new_tree_rows =
+                get_range_rows(new_tree_range);
+            if (tree_rows != new_tree_rows) {
+                invalidate_row_range(tree_rows);
+                invalidate_row_range(new_tree_rows);
+                locals_index.reset();
+                error_index.reset();
+            }
+
+            ts_tree_delete(tree_ptr);
+        } else {
+            highlight_cache.reset(buffer_ptr->num_lines());
+            locals_index.reset();
+            error_index.reset();
+        }
+        tree_ptr = new_tree;
+        tree_generation = new_tree_generation;
+        ++tree_version;
+        tree_rows = get_range_rows(new_tree_range);
+        update_locals();
+        update_errors();
+        return true;
+    }
+
+    bool has_tree() const {
+        return tree_ptr != nullptr;
     }
 
     // accesser methods for the tree
@@ -319,57 +611,458 @@ template <typename T> class Parser {
         ts_query_cursor_exec(query_cursor, query, ts_tree_root_node(tree_ptr));
     }
 
-    std::vector<Capture> get_captures_within(Point start_boundary,
-                                             Point end_boundary) const {
+    // makes sure every row in [first_row, last_row] has its spans cached;
+    // only runs the query over runs of rows that aren't
+    void prepare_highlights(size_t first_row, size_t last_row) const {
+        assert(grammar_ptr);
+        if (!tree_ptr) {
+            // first parse hasn't come back yet
+            return;
+        }
+
+        if (highlight_cache.num_lines() != buffer_ptr->num_lines()) {
+            // something edited the buffer behind our back
+            highlight_cache.reset(buffer_ptr->num_lines());
+        }
+        last_row = std::min(last_row, buffer_ptr->num_lines() - 1);
+
+        size_t row = first_row;
+        while (row <= last_row) {
+            if (highlight_cache.is_valid(row)) {
+                ++row;
+                continue;
+            }
+            size_t run_end = highlight_cache.invalid_run_end(row, last_row);
+            query_rows(row, run_end);
+            row = run_end;
+        }
+    }
+
+    bool has_line_highlights(size_t row) const {
+        return highlight_cache.is_valid(row);
+    }
 
-        assert(language.has_value());
+    std::vector<HighlightSpan> const &get_line_highlights(size_t row) const {
+        return highlight_cache.spans_at(row);
+    }
 
-        TSParser *parser = ts_parser_new();
-        ts_parser_set_language(parser_ptr, parser_function_ptr());
+    // the rows a fold at row should cover, going by the syntax tree: the
+    // outermost node that starts on row (a whole function for its signature
+    // line), else a node opened at the end of it (the block of `} else {`),
+    // else the innermost node row sits inside of. runs of line comments
+    // fold together.
+    std::optional<FoldSet::RowRange> get_fold_range(size_t row) const {
+        if (!tree_ptr || row >= buffer_ptr->num_lines()) {
+            return std::nullopt;
+        }
 
-        TSQueryError error_type;
-        uint32_t error_offset;
-        std::string_view lang_query_string = get_queries_str(language.value());
-        TSQuery *ts_query = ts_query_new(
-            parser_function_ptr(), lang_query_string.data(),
-            (unsigned int)lang_query_string.size(), &error_offset, &error_type);
+        std::string_view line = buffer_ptr->at(row);
+        size_t first_col = line.find_first_not_of(" \t");
+        size_t last_col = line.find_last_not_of(" \t");
+        if (first_col == std::string_view::npos) {
+            first_col = last_col = 0;
+        }
 
-        TSQueryCursor *ts_query_cursor = ts_query_cursor_new();
-        ts_query_cursor_exec(ts_query_cursor, ts_query,
-                             ts_tree_root_node(tree_ptr));
+        TSNode root = ts_tree_root_node(tree_ptr);
+        auto node_at = [&](size_t col) {
+            return ts_node_descendant_for_point_range(root, Point{row, col},
+                                                      Point{row, col});
+        };
+        auto start_row = [](TSNode node) -> size_t {
+            return ts_node_start_point(node).row;
+        };
 
-        std::vector<Capture> to_return;
+        TSNode first_node = node_at(first_col);
+        if (is_comment(first_node) && last_row_of(first_node) == row) {
+            FoldSet::RowRange run = comment_run_range(first_node);
+            if (run.second > run.first) {
+                return run;
+            }
+        }
 
-        TSQueryMatch ts_query_match;
-        uint32_t cap_index;
-        while (ts_query_cursor_next_capture(ts_query_cursor, &ts_query_match,
-                                            &cap_index)) {
-            // only pushback stuff that is at least partially within the range
-            Point start_point =
-                ts_node_start_point(ts_query_match.captures[cap_index].node);
-            Point end_point =
-                ts_node_end_point(ts_query_match.captures[cap_index].node);
+        // the root spans everything (or the whole window), so never fold it
+        std::optional<TSNode> maybe_fold_node;
+        for (TSNode node = first_node; !ts_node_is_null(ts_node_parent(node));
+             node = ts_node_parent(node)) {
+            if (start_row(node) != row) {
+                break;
+            }
+            if (last_row_of(node) > row) {
+                maybe_fold_node = node;
+            }
+        }
 
-            uint32_t size;
-            const char *a = ts_query_capture_name_for_id(
-                ts_query, ts_query_match.captures[cap_index].index, &size);
+        if (!maybe_fold_node) {
+            for (TSNode node = node_at(last_col);
+                 !ts_node_is_null(ts_node_parent(node));
+                 node = ts_node_parent(node)) {
+                if (start_row(node) != row) {
+                    break;
+                }
+                if (last_row_of(node) > row) {
+                    maybe_fold_node = node;
+                    break;
+                }
+            }
+        }
 
-            if (start_point >= end_boundary || end_point <= start_boundary) {
+        if (!maybe_fold_node) {
+            for (TSNode node = first_node;
+                 !ts_node_is_null(ts_node_parent(node));
+                 node = ts_node_parent(node)) {
+                if (start_row(node) < row &&
+                    last_row_of(node) > start_row(node)) {
+                    maybe_fold_node = node;
+                    break;
+                }
+            }
+        }
+
+        if (!maybe_fold_node) {
+            return std::nullopt;
+        }
+        return FoldSet::RowRange{start_row(*maybe_fold_node),
+                                 last_row_of(*maybe_fold_node)};
+    }
+
+    size_t num_errors() const {
+        return error_index.size();
+    }
+
+    // the start of the next (or previous) syntax error from point, wrapping
+    // around the ends of the file
+    std::optional<Point> next_error(Point point) const {
+        return error_index.next_error(point);
+    }
+
+    std::optional<Point> prev_error(Point point) const {
+        return error_index.prev_error(point);
+    }
+
+    // the header rows of the namespaces, classes and functions row sits
+    // inside of, outermost first; ones starting on row itself don't count.
+    // only walks the tree when row or the tree changed since the last call
+    std::vector<size_t> const &get_enclosing_scope_rows(size_t row) const {
+        if (scope_cache.row == row &&
+            scope_cache.tree_version == tree_version) {
+            return scope_cache.header_rows;
+        }
+
+        scope_cache.row = row;
+        scope_cache.tree_version = tree_version;
+        scope_cache.header_rows.clear();
+        if (!tree_ptr) {
+            return scope_cache.header_rows;
+        }
+
+        // a single descent: at every level, step into the child covering
+        // the start of row
+        TSTreeCursor tree_cursor =
+            ts_tree_cursor_new(ts_tree_root_node(tree_ptr));
+        while (ts_tree_cursor_goto_first_child_for_point(&tree_cursor,
+                                                         Point{row, 0}) >= 0) {
+            TSNode node = ts_tree_cursor_current_node(&tree_cursor);
+            size_t start_row = ts_node_start_point(node).row;
+            if (start_row >= row) {
+                break;
+            }
+            // a template and the class it declares start on the same row
+            bool is_new_row = scope_cache.header_rows.empty() ||
+                              scope_cache.header_rows.back() != start_row;
+            if (is_scope(node) && is_new_row) {
+                scope_cache.header_rows.push_back(start_row);
+            }
+        }
+        ts_tree_cursor_delete(&tree_cursor);
+        return scope_cache.header_rows;
+    }
+
+    // every multi-line node (or run of line comments) at the top of the
+    // tree, for folding everything at once
+    std::vector<FoldSet::RowRange> get_fold_ranges() const {
+        std::vector<FoldSet::RowRange> ranges;
+        if (!tree_ptr) {
+            return ranges;
+        }
+
+        TSNode root = ts_tree_root_node(tree_ptr);
+        uint32_t num_children = ts_node_named_child_count(root);
+        for (uint32_t idx = 0; idx < num_children; ++idx) {
+            TSNode child = ts_node_named_child(root, idx);
+            size_t first_row = ts_node_start_point(child).row;
+            if (is_comment(child) && last_row_of(child) == first_row) {
+                FoldSet::RowRange run = comment_run_range(child);
+                if (run.second > run.first &&
+                    (ranges.empty() || ranges.back().second < run.first)) {
+                    ranges.push_back(run);
+                }
                 continue;
             }
+            if (last_row_of(child) > first_row) {
+                ranges.push_back({first_row, last_row_of(child)});
+            }
+        }
+        return ranges;
+    }
+
+  private:
+    // going by the naming conventions grammars share, e.g.
+    // namespace_definition, class_specifier or function_item
+    static bool is_scope(TSNode node) {
+        static constexpr std::string_view scope_kinds[] = {
+            "namespace", "class",  "struct", "union",     "enum",  "function",
+            "method",    "module", "impl",   "interface", "trait", "mod"};
+        static constexpr std::string_view scope_suffixes[] = {
+            "_definition", "_specifier", "_declaration", "_item"};
+
+        if (!ts_node_is_named(node)) {
+            return false;
+        }
+        std::string_view type = ts_node_type(node);
+        return std::any_of(std::begin(scope_kinds), std::end(scope_kinds),
+                           [&](std::string_view kind) {
+                               return type.starts_with(kind);
+                           }) &&
+               std::any_of(std::begin(scope_suffixes),
+                           std::end(scope_suffixes),
+                           [&](std::string_view suffix) {
+                               return type.ends_with(suffix);
+                           });
+    }
+
+    static bool is_comment(TSNode node) {
+        return std::string_view{ts_node_type(node)}.find("comment") !=
+               std::string_view::npos;
+    }
+
+    // nodes that swallow their trailing newline end at column 0 of the row
+    // after
+    static size_t last_row_of(TSNode node) {
+        TSPoint start_point = ts_node_start_point(node);
+        TSPoint end_point = ts_node_end_point(node);
+        if (end_point.column == 0 && end_point.row > start_point.row) {
+            return end_point.row - 1;
+        }
+        return end_point.row;
+    }
+
+    // the rows of the line comments directly above and below comment_node,
+    // as long as each one is on a line of its own
+    FoldSet::RowRange comment_run_range(TSNode comment_node) const {
+        auto is_run_member = [&](TSNode node, size_t row) {
+            if (ts_node_is_null(node) || !is_comment(node)) {
+                return false;
+            }
+            TSPoint start_point = ts_node_start_point(node);
+            return start_point.row == row && last_row_of(node) == row &&
+                   buffer_ptr->at(row).find_first_not_of(" \t") ==
+                       start_point.column;
+        };
+
+        size_t row = ts_node_start_point(comment_node).row;
+        FoldSet::RowRange run{row, row};
+        for (TSNode node = ts_node_prev_sibling(comment_node);
+             run.first > 0 && is_run_member(node, run.first - 1);
+             node = ts_node_prev_sibling(node)) {
+            --run.first;
+        }
+        for (TSNode node = ts_node_next_sibling(comment_node);
+             run.second + 1 < buffer_ptr->num_lines() &&
+             is_run_member(node, run.second + 1);
+             node = ts_node_next_sibling(node)) {
+            ++run.second;
+        }
+        return run;
+    }
+
+    // requeries the locals of whatever the new tree (or edits since) dirtied
+    void update_locals() {
+        if (!grammar_ptr->locals_query) {
+            return;
+        }
+
+        auto changed_rows = locals_index.rebuild(
+            tree_ptr, grammar_ptr->locals_query, grammar_ptr->locals_captures,
+            grammar_ptr->locals_predicates, *buffer_ptr);
+        for (auto [first_row, last_row] : changed_rows) {
+            // a renamed definition recolours references further down
+            highlight_cache.invalidate_rows(first_row, last_row);
+        }
+
+        // the tree hasn't seen the text of these yet, so they need redoing
+        // with the next one
+        for (auto const &[gen, edit] : unparsed_edits) {
+            locals_index.mark_dirty(edit.start_point.row,
+                                    edit.new_end_point.row);
+        }
+    }
 
-            to_return.push_back({.start = start_point,
-                                 .end = end_point,
-                                 .capture_name = std::string_view{a, size}});
+    // rescans whatever the new tree (or edits since) dirtied for errors
+    void update_errors() {
+        for (auto [first_row, last_row] : error_index.rebuild(tree_ptr)) {
+            highlight_cache.invalidate_rows(first_row, last_row);
         }
+        for (auto const &[gen, edit] : unparsed_edits) {
+            error_index.mark_dirty(edit.start_point.row,
+                                   edit.new_end_point.row);
+        }
+    }
 
-        ts_query_cursor_delete(ts_query_cursor);
-        ts_query_delete(ts_query);
-        ts_parser_delete(parser);
+    // hands the worker either the whole buffer, or for large files just the
+    // lines in the window along with the range they cover.
+    //
+    // This runs at most once a frame, and only when there are edits. The
+    // copy is a plain deep copy of every line and of the LineSizeTree, so
+    // it's linear in what gets copied: whole buffers are only copied while
+    // snapshot_bytes() stays under EditorConfig::parse_window_bytes
+    // (set_viewport() switches to a window past that), and a window is at
+    // most 2 * window_margin_rows plus the viewport.
+    void submit_snapshot(TSTree *old_tree, uint64_t snapshot_generation) {
+        if (!window_rows) {
+            worker_ptr->submit(grammar_ptr->language, old_tree, *buffer_ptr,
+                               std::nullopt, snapshot_generation);
+            return;
+        }
 
-        return to_return;
+        // edits may have shrunk the buffer since the window was picked
+        size_t num_lines = buffer_ptr->num_lines();
+        size_t first_row = std::min(window_rows->first, num_lines - 1);
+        size_t end_row =
+            std::clamp(window_rows->second, first_row + 1, num_lines);
+        size_t last_col = buffer_ptr->at(end_row - 1).size();
+        // the newline after the last row isn't part of the window
+        size_t start_byte =
+            buffer_ptr->get_offset_from_point(Cursor{first_row, 0, 0});
+        size_t end_byte =
+            buffer_ptr->get_offset_from_point(Cursor{end_row - 1, last_col, 0});
+
+        TSRange included_range{.start_point = Point{first_row, 0},
+                               .end_point = Point{end_row - 1, last_col},
+                               .start_byte = (uint32_t)start_byte,
+                               .end_byte = (uint32_t)end_byte};
+        worker_ptr->submit(grammar_ptr->language, old_tree,
+                           buffer_ptr->slice(first_row, end_row),
+                           included_range, snapshot_generation);
+    }
+
+    std::optional<RowRange>
+    get_range_rows(std::optional<TSRange> const &maybe_range) const {
+        if (!maybe_range) {
+            return std::nullopt;
+        }
+        return RowRange{maybe_range->start_point.row,
+                        maybe_range->end_point.row + 1};
     }
 
+    void invalidate_row_range(std::optional<RowRange> const &maybe_rows) {
+        if (!maybe_rows) {
+            highlight_cache.invalidate_rows(0, buffer_ptr->num_lines() - 1);
+            return;
+        }
+        highlight_cache.invalidate_rows(maybe_rows->first,
+                                        maybe_rows->second - 1);
+    }
+
+    // runs the query over rows [first_row, end_row) and splits every capture
+    // into per-line spans for the cache
+    void query_rows(size_t first_row, size_t end_row) const {
+        std::vector<std::vector<HighlightSpan>> row_spans(end_row - first_row);
+
+        // splits [start_point, end_point) into per-line spans, clamped to
+        // the rows we asked for
+        auto add_spans = [&](Point start_point, Point end_point,
+                             uint16_t style_id) {
+            size_t row = std::max(start_point.row, first_row);
+            size_t last_row = std::min(end_point.row, end_row - 1);
+            for (; row <= last_row; ++row) {
+                size_t line_size = buffer_ptr->at(row).size();
+                size_t start_col =
+                    (row == start_point.row) ? start_point.col : 0;
+                size_t end_col =
+                    (row == end_point.row) ? end_point.col : line_size;
+                // a tree behind on edits can point past the end of a line
+                end_col = std::min(end_col, line_size);
+                if (start_col >= end_col) {
+                    continue;
+                }
+                row_spans[row - first_row].push_back(
+                    {.start_col = (uint32_t)start_col,
+                     .end_col = (uint32_t)end_col,
+                     .style_id = style_id});
+            }
+        };
+
+        // grammars without a highlights query still get their errors marked
+        if (grammar_ptr->highlights_query) {
+            TSQueryCursor *ts_query_cursor = ts_query_cursor_new();
+            // bound the cursor to the rows we're missing so that we only
+            // walk the captures that touch them, rather than every capture
+            // in the file
+            ts_query_cursor_set_point_range(
+                ts_query_cursor, Point{first_row, 0}, Point{end_row, 0});
+            ts_query_cursor_exec(ts_query_cursor,
+                                 grammar_ptr->highlights_query,
+                                 ts_tree_root_node(tree_ptr));
+
+            TSQueryMatch ts_query_match;
+            uint32_t cap_index;
+            while (ts_query_cursor_next_capture(
+                ts_query_cursor, &ts_query_match, &cap_index)) {
+                if (!grammar_ptr->highlights_predicates.is_satisfied(
+                        ts_query_match, *buffer_ptr)) {
+                    // drop the whole match, so none of its captures come back
+                    ts_query_cursor_remove_match(ts_query_cursor,
+                                                 ts_query_match.id);
+                    continue;
+                }
+
+                TSQueryCapture const &capture =
+                    ts_query_match.captures[cap_index];
+                uint16_t style_id = grammar_ptr->capture_styles[capture.index];
+                if (style_id == Highlighter::NO_STYLE) {
+                    // nothing in the theme for it, so don't bother storing it
+                    continue;
+                }
+
+                // the cursor can still hand us nodes that only touch the
+                // boundary, which add_spans clamps away
+                add_spans(ts_node_start_point(capture.node),
+                          ts_node_end_point(capture.node), style_id);
+            }
+            ts_query_cursor_delete(ts_query_cursor);
+        }
+
+        // these go last so that they win over the highlights query
+        locals_index.add_reference_spans(first_row, end_row, row_spans);
+
+        // and errors get underlined on top of everything
+        uint16_t error_style_id =
+            Highlighter::get().style_for_name("diagnostic.error");
+        auto [error_begin, error_end] =
+            error_index.errors_within(first_row, end_row);
+        if (error_style_id != Highlighter::NO_STYLE) {
+            for (auto it = error_begin; it != error_end; ++it) {
+                Point start_point = it->start_point;
+                Point end_point = it->end_point;
+                if (start_point == end_point) {
+                    // MISSING nodes take up no room; mark the character
+                    // before them instead
+                    start_point.col -= std::min(start_point.col, (size_t)1);
+                    end_point.col = start_point.col + 1;
+                }
+                add_spans(start_point, end_point, error_style_id);
+            }
+        }
+
+        // a tree that still has edits in flight will be replaced soon
+        bool provisional = !unparsed_edits.empty();
+        for (size_t idx = 0; idx < row_spans.size(); ++idx) {
+            highlight_cache.set_spans(first_row + idx,
+                                      std::move(row_spans[idx]), provisional);
+        }
+    }
+
+  public:
     friend std::ostream &operator<<(std::ostream &os, Parser const &parser) {
         TSTreeCursor cursor_at_root = parser.get_tree_cursor();
         ts_print_node(os, 0, cursor_at_root);
@@ -378,19 +1071,8 @@ template <typename T> class Parser {
     }
 
     std::string_view get_parser_lang_name() const {
-        assert(language);
-        switch (*language) {
-        case Parser::LANG::C:
-            return "C";
-        case Parser::LANG::CPP:
-            return "C++";
-        case Parser::LANG::PYTHON:
-            return "Python";
-        case Parser::LANG::JSON:
-            return "JSON";
-        default:
-            return "";
-        }
+        assert(grammar_ptr);
+        return grammar_ptr->name;
     }
 
     // make sure to grab by copy
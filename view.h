@@ -3,19 +3,26 @@
 #include <assert.h>
 #include <bits/types/wint_t.h>
 #include <cstdio>
-#include <deque>
 #include <signal.h>
 #include <stddef.h>
 
 #include <notcurses/notcurses.h>
 
 #include <algorithm>
+#include <list>
+#include <memory>
+#include <optional>
 #include <string>
 #include <string_view>
 #include <unordered_map>
 #include <utility>
 #include <vector>
 
+#include "Folds.h"
+#include "FrameWriter.h"
+#include "Highlighter.h"
+#include "LineHighlighter.h"
+#include "WrapIndex.h"
 #include "text_buffer.h"
 #include "util.h"
 
@@ -26,145 +33,38 @@
         NCCHANNELS_INITIALIZER(fg_r, fg_g, fg_b, bg_r, bg_g, bg_b),            \
         NCCHANNELS_INITIALIZER(fg_r, fg_g, fg_b, bg_r, bg_g, bg_b)
 
-// simple mapper from a "syntax type index" into a an RGB that we style the
-// text with For now we're hardcoding for the cpp syntax
-struct Highlighter {
-    struct Colour {
-        uint8_t r;
-        uint8_t g;
-        uint8_t b;
-
-        Colour()
-            : r(0),
-              g(0),
-              b(0) {
-        }
-
-        Colour(uint8_t r_, uint8_t g_, uint8_t b_)
-            : r(r_),
-              g(g_),
-              b(b_) {
-        }
-    };
-
-    enum class Style { UNDERLINE, BOLD, ITALICIZE };
-
-    struct Highlight {
-        std::optional<Colour> fg_colour;
-        std::optional<Colour> bg_colour;
-        uint16_t nc_style;
-
-        Highlight()
-            : fg_colour(std::nullopt),
-              bg_colour(std::nullopt),
-              nc_style(NCSTYLE_NONE) {
-        }
-
-        Highlight(Colour fgc)
-            : fg_colour(fgc),
-              bg_colour(std::nullopt),
-              nc_style(NCSTYLE_NONE) {
-        }
-
-        Highlight(Colour fgc, Colour bgc, uint16_t ncs)
-            : fg_colour(fgc),
-              bg_colour(bgc),
-              nc_style(ncs) {
-        }
-
-        bool has_fg_colour() const {
-            return fg_colour.has_value();
-        }
-
-        bool has_bg_colour() const {
-            return bg_colour.has_value();
-        }
+enum class WrapStatus {
+    WRAP,
+    NOWRAP,
+};
 
-        bool has_style() const {
-            return nc_style != NCSTYLE_NONE;
-        }
-    };
+// which way a text pane gets cut in two: HORIZONTAL stacks the halves on
+// top of each other, VERTICAL puts them side by side
+enum class Split {
+    HORIZONTAL,
+    VERTICAL,
+};
 
-    std::unordered_map<std::string_view, Highlight> capturing_name_to_colour;
+// FNV-1a, for telling whether a row would look the same as last frame
+struct RowHash {
+    uint64_t value = 0xcbf29ce484222325;
 
-    Highlight operator[]([[maybe_unused]] std::string_view capturing_name) {
-        if (auto it = capturing_name_to_colour.find(capturing_name);
-            it != capturing_name_to_colour.end()) {
-            return it->second;
+    void add_bytes(void const *data, size_t size) {
+        auto const *bytes = (unsigned char const *)data;
+        for (size_t idx = 0; idx < size; ++idx) {
+            value ^= bytes[idx];
+            value *= 0x100000001b3;
         }
-        return Highlight();
     }
 
-    // Hardcode the cpp values for now
-    Highlighter() {
-        capturing_name_to_colour["attribute"] = {
-            Colour{0x22, 0x3b, 0x7d},
-        };
-        capturing_name_to_colour["comment"] = {
-            Colour{0x79, 0x79, 0x79},
-        };
-        capturing_name_to_colour["type.builtin"] = {
-            Colour{0x22, 0x3b, 0x7d},
-        };
-        capturing_name_to_colour["constant.builtin.boolean"] = {
-            Colour{0x25, 0x47, 0xa9}};
-        capturing_name_to_colour["type"] = {Colour{0x4e, 0xc9, 0xb0}};
-        capturing_name_to_colour["type.enum.variant"] = {
-            Colour{0x4e, 0xc9, 0xb0}};
-        capturing_name_to_colour["string"] = {
-            Colour{0xae, 0x66, 0x41},
-        };
-        capturing_name_to_colour["constant.character"] = {
-            Colour{0xae, 0x66, 0x41}};
-        capturing_name_to_colour["constant.character.escape"] = {
-            Colour{0xc3, 0x8a, 0x3c}};
-        capturing_name_to_colour["constant.numeric"] = {
-            Colour{0xaf, 0xca, 0x9f}};
-        capturing_name_to_colour["function"] = {
-            Colour{0xdc, 0xdc, 0xaa},
-        };
-        capturing_name_to_colour["function.special"] = {
-            Colour{0xc5, 0x86, 0xc0}};
-        capturing_name_to_colour["keyword"] = {
-            Colour{0xc5, 0x86, 0xc0},
-        };
-        capturing_name_to_colour["keyword.control"] = {
-            Colour{0xa6, 0x79, 0xaf},
-        };
-        capturing_name_to_colour["keyword.control.conditional"] = {
-            Colour{0xa6, 0x79, 0xaf}};
-        capturing_name_to_colour["keyword.control.repeat"] = {
-            Colour{0xc5, 0x86, 0xc0}};
-        capturing_name_to_colour["keyword.control.return"] = {
-            Colour{0xc5, 0x86, 0xc0}};
-        capturing_name_to_colour["keyword.control.exception"] = {
-            Colour{0xc5, 0x86, 0xc0}};
-        capturing_name_to_colour["keyword.directive"] = {
-            Colour{0xc5, 0x86, 0xc0}};
-        capturing_name_to_colour["keyword.storage.modifier"] = {
-            Colour{0x22, 0x3b, 0x7d}};
-        capturing_name_to_colour["keyword.storage.type"] = {
-            Colour{0x22, 0x3b, 0x7d}};
-        capturing_name_to_colour["namespace"] = {
-            Colour{0x4e, 0xc8, 0xaf},
-        };
-        capturing_name_to_colour["punctuation.bracket"] = {
-            Colour{0xc5, 0x86, 0xc0}};
-        capturing_name_to_colour["variable"] = {
-            Colour{0x8e, 0xd3, 0xf9},
-        };
-        capturing_name_to_colour["variable.builtin"] = {
-            Colour{0xc5, 0x86, 0xc0}};
-        capturing_name_to_colour["variable.other.member"] = {
-            Colour{0x8e, 0xd3, 0xf9}};
-        capturing_name_to_colour["variable.parameter"] = {
-            Colour{0x8e, 0xd3, 0xf9}};
+    void add(size_t num) {
+        add_bytes(&num, sizeof(num));
     }
-};
 
-enum class WrapStatus {
-    WRAP,
-    NOWRAP,
+    void add(std::string_view str) {
+        add(str.size());
+        add_bytes(str.data(), str.size());
+    }
 };
 
 struct NCPlane {
@@ -265,22 +165,31 @@ class TextPlaneModel {
     Cursor const *cursor_ptr;
     std::optional<Cursor> const *anchor_cursor_ptr;
     std::optional<Parser<TextBuffer>> const *maybe_parser;
+    // only set up for buffers without a parser
+    std::optional<LineHighlighter> const *maybe_line_highlighter;
+    FoldSet const *folds_ptr;
 
   public:
     TextPlaneModel()
         : text_buffer_ptr(nullptr),
           cursor_ptr(nullptr),
           anchor_cursor_ptr(nullptr),
-          maybe_parser(nullptr) {
+          maybe_parser(nullptr),
+          maybe_line_highlighter(nullptr),
+          folds_ptr(nullptr) {
     }
 
     TextPlaneModel(TextBuffer const *tbp, Cursor const *cp,
                    std::optional<Cursor> const *acp,
-                   std::optional<Parser<TextBuffer>> const *mp)
+                   std::optional<Parser<TextBuffer>> const *mp,
+                   std::optional<LineHighlighter> const *mlhp,
+                   FoldSet const *fp)
         : text_buffer_ptr(tbp),
           cursor_ptr(cp),
           anchor_cursor_ptr(acp),
-          maybe_parser(mp) {
+          maybe_parser(mp),
+          maybe_line_highlighter(mlhp),
+          folds_ptr(fp) {
     }
 
     std::vector<std::string_view> get_lines(size_t pos,
@@ -312,41 +221,208 @@ class TextPlaneModel {
         return maybe_parser->has_value();
     }
 
-    std::vector<Capture> get_captures_within(Point tl, Point br) const {
-        assert(maybe_parser->has_value());
-        return maybe_parser->value().get_captures_within(tl, br);
+    // either the parser, or the regex line highlighter as a fallback
+    bool has_highlights() const {
+        return maybe_parser->has_value() || maybe_line_highlighter->has_value();
+    }
+
+    void prepare_highlights(size_t first_row, size_t last_row) const {
+        assert(has_highlights());
+        if (maybe_parser->has_value()) {
+            maybe_parser->value().prepare_highlights(first_row, last_row);
+        } else {
+            maybe_line_highlighter->value().prepare_highlights(
+                first_row, last_row, *text_buffer_ptr);
+        }
+    }
+
+    bool has_line_highlights(size_t row) const {
+        if (maybe_parser->has_value()) {
+            return maybe_parser->value().has_line_highlights(row);
+        }
+        return maybe_line_highlighter->value().has_line_highlights(row);
+    }
+
+    std::vector<HighlightSpan> const &get_line_highlights(size_t row) const {
+        if (maybe_parser->has_value()) {
+            return maybe_parser->value().get_line_highlights(row);
+        }
+        return maybe_line_highlighter->value().get_line_highlights(row);
+    }
+
+    bool is_hidden(size_t row) const {
+        return folds_ptr->is_hidden(row);
+    }
+
+    bool is_fold_header(size_t row) const {
+        return folds_ptr->is_fold_header(row);
+    }
+
+    size_t visible_row_for(size_t row) const {
+        return folds_ptr->visible_row_for(row);
+    }
+
+    size_t next_visible_row(size_t row) const {
+        return folds_ptr->next_visible_row(row);
+    }
+
+    size_t prev_visible_row(size_t row) const {
+        return folds_ptr->prev_visible_row(row);
+    }
+
+    size_t visible_index(size_t row) const {
+        return folds_ptr->visible_index(row);
+    }
+
+    size_t row_at_visible_index(size_t visible_idx) const {
+        return folds_ptr->row_at_visible_index(visible_idx);
+    }
+
+    uint64_t folds_version() const {
+        return folds_ptr->get_version();
+    }
+
+    std::optional<FoldSet::RowRange>
+    fold_changes_since(uint64_t since_version) const {
+        return folds_ptr->changes_since(since_version);
+    }
+
+    std::vector<size_t> const &get_enclosing_scope_rows(size_t row) const {
+        return maybe_parser->value().get_enclosing_scope_rows(row);
     }
 };
 
 class TextPlane {
-    // TODO: just stick this here for now
-    inline static Highlighter highlighter;
-
     friend class View;
 
     TextPlaneModel model;
 
     WrapStatus wrap_status;
+    // with wrap on, break rows after spaces rather than anywhere
+    bool wrap_at_words;
 
     NCPlane text_plane;
     NCPlane cursor_plane;
     NCPlane line_number_plane;
+    // the enclosing scopes of the top line, drawn over the first few rows
+    NCPlane sticky_plane;
     Point tl_corner;
     Point br_corner; // exclusive range that we also maintain
+    // with wrap off, how many screen columns are scrolled off to the left
+    size_t left_x;
 
     // buffer to hold temporarily rendered text
     std::vector<std::pair<Point, Point>> line_points;
+    // what each visual row shows this frame, tabs already expanded
+    std::vector<std::string> row_texts;
+
+    // one cell of a row that's about to be drawn
+    struct RowCell {
+        uint64_t channels; // 0 keeps the plane's defaults
+        uint16_t stylemask;
+
+        friend bool operator==(RowCell const &, RowCell const &) = default;
+    };
+    // scratch space for render_text, kept around to avoid allocations
+    std::vector<RowCell> row_cells;
+
+    // Per-frame layout table, built by layout_rows(): the screen column of
+    // every buffer column on every visual row (plus one past the end),
+    // flattened, with visual row idx starting at layout_offsets[idx]. Going
+    // from a point to the screen is a binary search over line_points and
+    // then one read from here.
+    std::vector<size_t> layout_xs;
+    std::vector<size_t> layout_offsets;
+
+    // Visual rows per buffer row with wrap on (folded rows take none), for
+    // going between points and visual rows without walking the buffer. It's
+    // only good for the width and the folds it was built with, and gets
+    // rebuilt lazily once either changes; edits just update their rows.
+    WrapIndex wrap_index;
+    bool wrap_index_valid;
+    size_t wrap_index_cols;
+    uint64_t wrap_index_folds_version;
+
+    // With wrap off, the byte offsets of the tabs on long rows (tabs are
+    // the only bytes wider than one column), so that finding the first byte
+    // inside the horizontal window is a binary search rather than a walk
+    // from the start of the row. Rows only get in here once they're drawn,
+    // and edits drop the rows they touched.
+    struct TabOffsets {
+        size_t line_size; // to catch rows that changed behind our back
+        std::vector<size_t> offsets;
+    };
+    std::unordered_map<size_t, TabOffsets> long_row_tabs;
+
+    // With wrap on, where each row breaks into visual rows (the chunk
+    // starts from StringUtils::columns_of_chunked_text). Worked out once
+    // per row for the current width and wrap mode, so moving up and down
+    // through a wrapped row is a binary search; edits drop the rows they
+    // touched, same as long_row_tabs.
+    struct WrapBreaks {
+        size_t line_size;
+        std::vector<std::pair<size_t, size_t>> chunk_starts;
+    };
+    std::unordered_map<size_t, WrapBreaks> wrap_breaks_cache;
+    size_t wrap_breaks_cols;
+    // rows too short to ever wrap all share this
+    static inline std::vector<std::pair<size_t, size_t>> const
+        unwrapped_chunk_starts = {{0, 0}};
+    // short rows are cheap enough to just scan every time
+    static constexpr size_t long_row_size = 1024;
+    TabOffsets short_row_tabs;
+
+    // Damage tracking: each visual row's text, highlights and selection get
+    // hashed, and only rows whose hash differs from last frame's get erased
+    // and drawn again. Anything that draws onto text_plane has to check
+    // dirty_rows first.
+    std::pair<unsigned int, unsigned int> drawn_dims;
+    std::vector<uint64_t> drawn_row_hashes;
+    std::vector<bool> dirty_rows;
+    // same idea for the line numbers and the sticky header
+    std::vector<std::string> drawn_line_numbers;
+    uint64_t drawn_sticky_hash;
+    // buffer rows shown in the sticky header this frame
+    std::vector<size_t> sticky_rows;
+    // how many rows the header took last frame before making room for the
+    // cursor, i.e. how many rows at the top the cursor can't be seen in
+    size_t sticky_height;
+    // the visual row the cursor is drawn on, if it's on screen
+    std::optional<size_t> maybe_cursor_row;
+
+    // what the last full render laid the rows out for; if none of it has
+    // changed since, a cursor that moved is all there is to draw
+    struct DrawnView {
+        Point tl_corner;
+        size_t left_x;
+        WrapStatus wrap_status;
+        bool wrap_at_words;
+        bool has_selection;
+
+        friend bool operator==(DrawnView const &, DrawnView const &) = default;
+    };
+    std::optional<DrawnView> maybe_drawn_view;
 
   public:
     TextPlane(NCPlane &parent_plane, TextPlaneModel tpm, unsigned int num_rows,
               unsigned int num_cols)
         : model(tpm),
           wrap_status(WrapStatus::WRAP),
+          wrap_at_words(false),
           text_plane(parent_plane, 0, 4, num_rows, num_cols - 4),
           cursor_plane(text_plane, 0, 4, 1, 1),
           line_number_plane(text_plane, 0, -4, num_rows, 4),
+          sticky_plane(text_plane, 0, 0, 1, num_cols - 4),
           tl_corner(Point{0, 0}),
-          br_corner(Point{std::string::npos, std::string::npos}) {
+          br_corner(Point{std::string::npos, std::string::npos}),
+          left_x(0),
+          wrap_index_valid(false),
+          wrap_index_cols(0),
+          wrap_index_folds_version(0),
+          wrap_breaks_cols(0),
+          drawn_dims({0, 0}),
+          drawn_sticky_hash(0),
+          sticky_height(0) {
 
         // initially model is uninitialised
 
@@ -365,6 +441,11 @@ class TextPlane {
 
         ncplane_set_base_cell(line_number_plane.get(),
                               &line_number_plane_base_cell);
+
+        nccell sticky_plane_base_cell{.channels = NCCHANNELS_INITIALIZER(
+                                          0xff, 0xff, 0xff, 0x3c, 0x3c, 0x3c)};
+        ncplane_set_base_cell(sticky_plane.get(), &sticky_plane_base_cell);
+        ncplane_move_below(sticky_plane.get(), text_plane.get());
     }
 
     ~TextPlane() {
@@ -375,13 +456,36 @@ class TextPlane {
     TextPlane &operator=(TextPlane &&) = default;
 
     void render() {
-        // make this vector a fixed array to avoid allocations?
+        if (wrap_status == WrapStatus::WRAP) {
+            ensure_wrap_index();
+        }
+        layout_rows();
+        if (model.has_highlights()) {
+            prepare_highlights();
+        }
+        find_damaged_rows();
+
         render_text();
         render_cursor();
-        if (model.has_parser()) {
-            render_highlights();
+        // the header decides what the first few line numbers are
+        render_sticky_header();
+        render_line_numbers();
+        maybe_drawn_view = current_view();
+    }
+
+    // for when only the cursor moved and the buffer didn't change: unless
+    // that scrolled the view or touched a selection, the rows on screen are
+    // still right and only the cursor has to go somewhere else
+    void render_cursor_move() {
+        // a selection follows the cursor around, so it gets redrawn
+        if (model.has_anchor() || maybe_drawn_view != current_view() ||
+            get_plane_yx_dim() != drawn_dims) {
+            render();
+            return;
         }
-        render_selection();
+        render_cursor();
+        // the header gives way to a cursor that moved up under it
+        render_sticky_header();
         render_line_numbers();
     }
 
@@ -389,214 +493,344 @@ class TextPlane {
         return wrap_status;
     }
 
-    ssize_t num_visual_lines_from_tl(Point const &p) {
-        auto [row_count, col_count] = get_plane_yx_dim();
-
-        if (wrap_status == WrapStatus::NOWRAP) {
-            return (ssize_t)p.row - (ssize_t)tl_corner.row;
+    // call chase_point afterwards to bring the cursor back into view
+    void set_wrap_status(WrapStatus ws) {
+        if (ws == wrap_status) {
+            return;
         }
+        wrap_status = ws;
+        // the top row is now drawn from its start, whichever way we went
+        tl_corner.col = 0;
+        left_x = 0;
+        wrap_index_valid = false;
+    }
 
-        Point aligned_point = p;
-        aligned_point.col = aligned_point.col / col_count *
-                            col_count; // round to the nearest chunk
+    bool get_wrap_at_words() const {
+        return wrap_at_words;
+    }
 
-        if (aligned_point == tl_corner) {
-            return 0;
+    // call chase_point afterwards to bring the cursor back into view
+    void set_wrap_at_words(bool waw) {
+        if (waw == wrap_at_words) {
+            return;
         }
-
-        if (aligned_point.row == tl_corner.row) {
-            return ((ssize_t)aligned_point.col - (ssize_t)tl_corner.col) /
-                   (ssize_t)col_count;
+        wrap_at_words = waw;
+        // chunks start in different places now
+        tl_corner.col = 0;
+        wrap_index_valid = false;
+        wrap_breaks_cache.clear();
+    }
+
+    // the chunks row gets wrapped into with wrap on, as (col, effective col)
+    // pairs; see wrap_breaks_cache
+    std::vector<std::pair<size_t, size_t>> const &
+    get_wrap_breaks(size_t row) {
+        size_t col_count = get_plane_yx_dim().second;
+        std::string_view line = model.at(row);
+        // can't reach the edge even if it's all tabs
+        if (line.size() * 4 <= col_count) {
+            return unwrapped_chunk_starts;
         }
 
-        ssize_t num_visual_lines = 0;
-        auto [start, end] = std::minmax(p.row, tl_corner.row);
-        for (size_t idx = start + 1; idx < end; ++idx) {
-            num_visual_lines +=
-                std::max(model.at(idx).size() / col_count, (size_t)1);
+        if (col_count != wrap_breaks_cols) {
+            wrap_breaks_cache.clear();
+            wrap_breaks_cols = col_count;
+        }
+        auto it = wrap_breaks_cache.find(row);
+        if (it != wrap_breaks_cache.end() &&
+            it->second.line_size == line.size()) {
+            return it->second.chunk_starts;
+        }
+        // only what's been on screen lately is worth keeping
+        if (wrap_breaks_cache.size() >= 1024) {
+            wrap_breaks_cache.clear();
+        }
+        WrapBreaks &breaks = wrap_breaks_cache[row];
+        breaks.line_size = line.size();
+        breaks.chunk_starts = StringUtils::columns_of_chunked_text(
+            line, col_count, wrap_at_words);
+        return breaks.chunk_starts;
+    }
+
+    // first and last buffer rows that can be on screen (inclusive); with
+    // wrapping on, fewer rows may actually fit
+    std::pair<size_t, size_t> get_visible_rows() {
+        size_t row_count = get_plane_yx_dim().first;
+        size_t last_row = model.row_at_visible_index(
+            model.visible_index(tl_corner.row) + row_count - 1);
+        return {tl_corner.row, last_row};
+    }
+
+    // the buffer point drawn at (y, x) of the text plane, e.g. for mouse
+    // clicks; clicking past the end of a row gives the end of it
+    std::optional<Point> point_at_screen(size_t y, size_t x) const {
+        if (y >= line_points.size()) {
+            return std::nullopt;
+        }
+        auto [row_start, row_end] = line_points[y];
+        auto begin = layout_xs.begin() + (ssize_t)layout_offsets[y];
+        auto end = begin + (ssize_t)(row_end.col - row_start.col + 1);
+        // the last column that starts at or before x
+        auto it = std::upper_bound(begin, end, x) - 1;
+        return Point{row_start.row, row_start.col + (size_t)(it - begin)};
+    }
+
+    ssize_t num_visual_lines_from_tl(Point const &point) {
+        return (ssize_t)visual_index_of(point) -
+               (ssize_t)visual_index_of(tl_corner);
+    }
+
+    // [start, old_end) of the buffer got replaced by [start, new_end); call
+    // this after the folds heard about it
+    void apply_edit(Point start, Point old_end, Point new_end) {
+        size_t start_row = start.row;
+        size_t old_end_row = old_end.row;
+        size_t new_end_row = new_end.row;
+
+        // keep showing the same text, even if it was another pane's edit
+        if (tl_corner.row > old_end_row) {
+            tl_corner.row = tl_corner.row - old_end_row + new_end_row;
+        } else if (tl_corner >= start) {
+            tl_corner = Point{start_row, 0};
         }
+        clamp_tl_corner();
 
-        if (p > tl_corner) {
-            size_t tl_row_len = model.at(tl_corner.row).size();
-            num_visual_lines += (tl_row_len - tl_corner.col) / col_count + 1;
-            num_visual_lines += (aligned_point.col) / col_count;
-        } else {
-            assert(p < tl_corner);
-            size_t ap_row_len = model.at(aligned_point.row).size();
-            num_visual_lines +=
-                (ap_row_len - aligned_point.col) / col_count + 1;
-            num_visual_lines += (tl_corner.col) / col_count;
+        // rows below the edit may have moved, and the caches only hold rows
+        // that were on screen lately, so just drop everything from
+        // start_row down
+        auto at_or_below_edit = [&](auto const &entry) {
+            return entry.first >= start_row;
+        };
+        std::erase_if(long_row_tabs, at_or_below_edit);
+        std::erase_if(wrap_breaks_cache, at_or_below_edit);
+
+        if (!wrap_index_valid ||
+            wrap_index_folds_version != model.folds_version() ||
+            wrap_index.size() - (old_end_row - start_row) +
+                    (new_end_row - start_row) !=
+                model.num_lines()) {
+            wrap_index_valid = false;
+            return;
+        }
 
-            num_visual_lines *= -1;
+        std::vector<uint32_t> new_counts;
+        new_counts.reserve(new_end_row - start_row + 1);
+        for (size_t row = start_row; row <= new_end_row; ++row) {
+            new_counts.push_back(model.is_hidden(row) ? 0 : wrapped_rows(row));
         }
+        wrap_index.replace(start_row, old_end_row, new_counts);
+    }
 
-        return num_visual_lines;
+    // puts the pane, line numbers included, at (y, x) of its parent with the
+    // given size. The next render lays everything out again.
+    void move_resize(int y, int x, unsigned int num_rows,
+                     unsigned int num_cols) {
+        assert(num_rows > 0 && num_cols > 4);
+        ncplane_move_yx(text_plane.get(), y, x + 4);
+        ncplane_resize_simple(text_plane.get(), num_rows, num_cols - 4);
+        ncplane_resize_simple(line_number_plane.get(), num_rows, 4);
     }
 
-  private:
-    void apply_highlight_on_range(
-        Point range_start, Point range_end,
-        [[maybe_unused]] Highlighter::Highlight highlight) {
-
-        // gives the index into line_points
-        auto find_visual_row_containing_point = [&](Point p) -> size_t {
-            size_t row_idx = 0;
-            while (row_idx < line_points.size()) {
-                if (line_points[row_idx].first <= p &&
-                    p <= line_points[row_idx].second) {
-                    return row_idx;
-                }
-                ++row_idx;
-            }
-            return row_idx;
-        };
+    // e.g. when a whole new file got loaded in
+    void invalidate_layout() {
+        wrap_index_valid = false;
+        long_row_tabs.clear();
+        wrap_breaks_cache.clear();
+        tl_corner = Point{0, 0};
+        left_x = 0;
+    }
 
-        // need this for base colour things
-        nccell base_cell;
-        ncplane_base(text_plane.get(), &base_cell);
+  private:
+    // puts the top left corner back on a visible row of the buffer
+    void clamp_tl_corner() {
+        if (tl_corner.row >= model.num_lines()) {
+            tl_corner = Point{model.num_lines() - 1, 0};
+        }
+        if (model.is_hidden(tl_corner.row)) {
+            tl_corner = Point{model.visible_row_for(tl_corner.row), 0};
+        }
+        tl_corner.col = std::min(tl_corner.col, model.at(tl_corner.row).size());
+    }
 
-        auto apply_style = [=, this](size_t y, size_t x, size_t ylen,
-                                     size_t xlen,
-                                     Highlighter::Highlight hl) -> void {
-            // we first obtain the base fg and bg
+    DrawnView current_view() const {
+        return DrawnView{tl_corner, left_x, wrap_status, wrap_at_words,
+                         model.has_anchor()};
+    }
 
-            unsigned fg_r, fg_g, fg_b, bg_r, bg_g, bg_b;
-            ncchannels_fg_rgb8(base_cell.channels, &fg_r, &fg_g, &fg_b);
-            ncchannels_bg_rgb8(base_cell.channels, &bg_r, &bg_g, &bg_b);
+    void prepare_highlights() {
+        if (line_points.empty()) {
+            return;
+        }
 
-            bool restain = false;
-            if (hl.has_fg_colour()) {
-                fg_r = hl.fg_colour->r;
-                fg_g = hl.fg_colour->g;
-                fg_b = hl.fg_colour->b;
-                restain = true;
+        // only rows that aren't cached yet cost us any query work; rows
+        // inside folds don't need any at all
+        size_t first_row = line_points.front().first.row;
+        size_t last_row = line_points.back().second.row;
+        size_t run_start = first_row;
+        for (size_t row = first_row; row <= last_row;
+             row = model.next_visible_row(row)) {
+            if (row == last_row || model.is_fold_header(row)) {
+                model.prepare_highlights(run_start, row);
+                run_start = model.next_visible_row(row);
             }
+        }
+    }
 
-            if (hl.has_bg_colour()) {
-                bg_r = hl.bg_colour->r;
-                bg_g = hl.bg_colour->g;
-                bg_b = hl.bg_colour->b;
-                restain = true;
-            }
+    void render_line_numbers() {
+        // TODO: on the first number, indicate if there's more to that line
+        // being wrapped from the previous visual row
 
-            if (restain) {
-                ncplane_stain(text_plane.get(), (int)y, (int)x,
-                              (unsigned int)ylen, (unsigned int)xlen,
-                              ncstain_args(fg_r, fg_g, fg_b, bg_r, bg_g, bg_b));
-            }
+        size_t row_count = get_yx_dim(line_number_plane.get()).first;
+        drawn_line_numbers.resize(row_count);
 
-            if (hl.has_style()) {
-                ncplane_format(text_plane.get(), (int)y, (int)x,
-                               (unsigned int)ylen, (unsigned int)xlen,
-                               hl.nc_style);
+        std::string label;
+        char out_str[5];
+        for (size_t visual_row_idx = 0; visual_row_idx < row_count;
+             ++visual_row_idx) {
+            // rows under the sticky header get the numbers of its rows,
+            // everything else only gets numbered on its first visual row
+            bool is_sticky = visual_row_idx < sticky_rows.size();
+            bool is_fold_header = false;
+            label.clear();
+            if (is_sticky) {
+                snprintf(out_str, 5, "%-4zu", sticky_rows[visual_row_idx] + 1);
+                label = out_str;
+            } else if (visual_row_idx < line_points.size() &&
+                       (visual_row_idx == 0 ||
+                        line_points[visual_row_idx].first.row !=
+                            line_points[visual_row_idx - 1].first.row)) {
+                size_t row = line_points[visual_row_idx].first.row;
+                snprintf(out_str, 4, "%zu", row + 1);
+                label = out_str;
+                is_fold_header = model.is_fold_header(row);
+                if (is_fold_header) {
+                    label += '+';
+                }
             }
-        };
 
-        auto col_to_width = [this](size_t row, size_t col) -> size_t {
-            assert(col <= model.at(row).size());
-            size_t width = 0;
-            for (size_t c = 0; c < col; ++c) {
-                width += StringUtils::symbol_into_width(model.at(row)[c]);
+            if (label == drawn_line_numbers[visual_row_idx]) {
+                continue;
             }
-            return width;
-        };
-
-        // clamp the points if you must
-        range_start = std::max(range_start, line_points.front().first);
-        range_end =
-            std::min(range_end, line_points.back().second); // this is exclusive
-
-        // need to assert that the range intersects the screen
-        assert(range_end >= line_points.front().first &&
-               range_start < line_points.back().second);
-
-        size_t starting_visual_row =
-            find_visual_row_containing_point(range_start);
-        size_t ending_visual_row = find_visual_row_containing_point(range_end);
-
-        assert(starting_visual_row <= ending_visual_row);
-        if (starting_visual_row == ending_visual_row) {
-            size_t starting_col =
-                col_to_width(range_start.row, range_start.col);
-            size_t ending_col = col_to_width(range_start.row, range_end.col);
-            apply_style(starting_visual_row, starting_col, 1,
-                        ending_col - starting_col, highlight);
-            return;
-        }
+            drawn_line_numbers[visual_row_idx] = label;
 
-        {
-            size_t starting_col =
-                col_to_width(range_start.row, range_start.col);
-            size_t ending_col = StringUtils::var_width_str_into_effective_width(
-                model.at(range_start.row));
-            apply_style(starting_visual_row, starting_col, 1,
-                        ending_col - starting_col, highlight);
-        }
-        {
-            size_t ending_col = col_to_width(range_end.row, range_end.col);
-            if (ending_col > 0) {
-                apply_style(ending_visual_row, 0, 1, ending_col, highlight);
+            ncplane_erase_region(line_number_plane.get(), (int)visual_row_idx,
+                                 0, 1, 4);
+            if (is_sticky) {
+                ncplane_putnstr_yx(line_number_plane.get(),
+                                   (int)visual_row_idx, 0, 4, out_str);
+            } else if (!label.empty()) {
+                ncplane_putnstr_yx(line_number_plane.get(),
+                                   (int)visual_row_idx, 0, 3, out_str);
             }
-        }
-        {
-            for (size_t row = starting_visual_row + 1; row < ending_visual_row;
-                 ++row) {
-                size_t length = StringUtils::var_width_str_into_effective_width(
-                    model.at(row));
-                apply_style(row, 0, 1, length, highlight);
+            if (is_fold_header) {
+                ncplane_putchar_yx(line_number_plane.get(),
+                                   (int)visual_row_idx, 3, '+');
             }
         }
     }
 
-    void render_highlights() {
-        // get highlight list from the model
-        std::vector<Capture> captures = model.get_captures_within(
-            line_points.front().first, line_points.back().second);
-
-        // TODO: I just want to verify that no point is going to be highlighted
-        // twice
+    // the innermost scopes around row, at most max_rows of them
+    void set_sticky_rows(size_t row, size_t max_rows) {
+        std::vector<size_t> const &scope_rows =
+            model.get_enclosing_scope_rows(row);
+        size_t num_rows = std::min(scope_rows.size(), max_rows);
+        sticky_rows.assign(scope_rows.end() - (ssize_t)num_rows,
+                           scope_rows.end());
+    }
 
-        for (auto capture : captures) {
-            apply_highlight_on_range(capture.start, capture.end,
-                                     highlighter[capture.capture_name]);
+    void render_sticky_header() {
+        auto [row_count, col_count] = get_plane_yx_dim();
+        // never take up more than a third of the screen
+        size_t max_rows = row_count / 3;
+        sticky_rows.clear();
+        if (model.has_parser() && max_rows > 0 && !line_points.empty()) {
+            // The header covers its own rows, so it's about the first row
+            // below it, which depends on how tall it is. Start from last
+            // frame's height (the scopes are cached by the parser, so that's
+            // free unless we scrolled) and go until the two agree.
+            size_t height = std::min(sticky_height, max_rows);
+            for (size_t tries = 0; tries <= max_rows; ++tries) {
+                size_t idx = std::min(height, line_points.size() - 1);
+                set_sticky_rows(line_points[idx].first.row, max_rows);
+                if (sticky_rows.size() == height) {
+                    break;
+                }
+                height = sticky_rows.size();
+            }
+            // a header that ended up shorter shows some of those rows anyway
+            while (!sticky_rows.empty() &&
+                   sticky_rows.back() >=
+                       line_points[std::min(sticky_rows.size(),
+                                            line_points.size() - 1)]
+                           .first.row) {
+                sticky_rows.pop_back();
+            }
+        }
+        // chase_point keeps the cursor this far from the top
+        sticky_height = sticky_rows.size();
+
+        // and if it's up there anyway, the outer scopes make room for it
+        if (maybe_cursor_row && *maybe_cursor_row < sticky_rows.size()) {
+            sticky_rows.erase(sticky_rows.begin(),
+                              sticky_rows.end() -
+                                  (ssize_t)*maybe_cursor_row);
         }
-    }
 
-    void render_selection() {
-        if (!model.has_anchor()) {
+        if (sticky_rows.empty()) {
+            ncplane_move_below(sticky_plane.get(), text_plane.get());
+            drawn_sticky_hash = 0;
             return;
         }
-        auto [lp, rp] = std::minmax(model.get_anchor(), model.get_cursor());
-        Highlighter::Highlight selection_highlight = Highlighter::Highlight{
-            Highlighter::Colour{0, 0, 0}, Highlighter::Colour{0xff, 0xff, 0xff},
-            NCSTYLE_UNDERLINE};
-        apply_highlight_on_range(lp, rp, selection_highlight);
-    }
+        size_t num_rows = sticky_rows.size();
+        ncplane_move_above(sticky_plane.get(), cursor_plane.get());
+
+        // the header usually stays put while we type below it
+        RowHash sticky_hash;
+        sticky_hash.add(col_count);
+        for (size_t row : sticky_rows) {
+            sticky_hash.add(row);
+            sticky_hash.add(model.at(row));
+        }
+        if (sticky_hash.value == drawn_sticky_hash) {
+            return;
+        }
+        drawn_sticky_hash = sticky_hash.value;
 
-    void render_line_numbers() {
-        // TODO: on the first number, indicate if there's more to that line
-        // being wrapped from the previous visual row
+        ncplane_resize_simple(sticky_plane.get(), (unsigned int)num_rows,
+                              col_count);
+        ncplane_erase(sticky_plane.get());
 
-        ncplane_erase(line_number_plane.get());
-        size_t curr_logical_row = std::string::npos;
+        char vis_line_buf[col_count + 1];
+        for (size_t idx = 0; idx < num_rows; ++idx) {
+            std::string_view line = model.at(sticky_rows[idx]);
 
-        char out_str[5];
-        for (size_t visual_row_idx = 0; visual_row_idx < line_points.size();
-             ++visual_row_idx) {
-            if (curr_logical_row != line_points.at(visual_row_idx).first.row) {
-                curr_logical_row = line_points.at(visual_row_idx).first.row;
-                snprintf(out_str, 5, "%zu", curr_logical_row + 1);
-                ncplane_putnstr_yx(line_number_plane.get(),
-                                   (int)(visual_row_idx), 0, 3, out_str);
+            size_t buf_idx = 0;
+            for (size_t col = 0; col < line.size() && buf_idx < col_count;
+                 ++col) {
+                if (line[col] != '\t') {
+                    vis_line_buf[buf_idx++] = line[col];
+                    continue;
+                }
+                for (size_t i = 0; i < 4 && buf_idx < col_count; ++i) {
+                    vis_line_buf[buf_idx++] = ' ';
+                }
             }
+            vis_line_buf[buf_idx] = '\0';
+            ncplane_putnstr_yx(sticky_plane.get(), (int)idx, 0, buf_idx,
+                               vis_line_buf);
         }
+        // separates the header from the text scrolling under it
+        ncplane_format(sticky_plane.get(), (int)num_rows - 1, 0, 1, col_count,
+                       NCSTYLE_UNDERLINE);
     }
 
     void render_cursor() {
+        maybe_cursor_row.reset();
 
         // if our text plane right now doesn't contain the cursor
         // we just hide the cursor and return;
-        if (model.get_cursor() > line_points.back().second ||
+        if (line_points.empty() ||
+            model.get_cursor() > line_points.back().second ||
             model.get_cursor() < line_points.front().first) {
             ncplane_move_below(cursor_plane.get(), text_plane.get());
             return;
@@ -604,109 +838,145 @@ class TextPlane {
 
         auto [row_count, col_count] = get_plane_yx_dim();
         // need to find where to put the cursor
-        Cursor logical_cursor = model.get_cursor();
-        std::string_view curr_line = model.at(logical_cursor.row);
-
-        size_t vis_row = line_points.size() - 1;
-        for (size_t idx = 0; idx < line_points.size(); ++idx) {
-            if (line_points[idx].first <= logical_cursor &&
-                logical_cursor <= line_points[idx].second) {
-                vis_row = idx;
-                break;
-            }
-
-            if (logical_cursor < line_points[idx].first) {
-                assert(idx > 1);
-                vis_row = idx - 1;
-                break;
+        Point logical_cursor = model.get_cursor();
+        size_t vis_row = visual_row_of(logical_cursor);
+        // a cursor right where a row wraps goes at the start of the next
+        // visual row. With wrap off, a cursor left of the window comes back
+        // as the row above its own.
+        if (vis_row + 1 < line_points.size()) {
+            Point next_start = line_points[vis_row + 1].first;
+            if (next_start == logical_cursor ||
+                (wrap_status == WrapStatus::NOWRAP &&
+                 next_start.row == logical_cursor.row)) {
+                ++vis_row;
             }
         }
 
-        // now translate this into a vis_col
-        size_t vis_col = 0;
+        maybe_cursor_row = vis_row;
 
-        curr_line = curr_line.substr(line_points[vis_row].first.col,
-                                     logical_cursor.col -
-                                         line_points[vis_row].first.col);
-        for (char c : curr_line) {
-            vis_col += StringUtils::symbol_into_width(c);
+        // a cursor hidden in a fold sits on its header
+        size_t vis_col = 0;
+        auto [row_start, row_end] = line_points[vis_row];
+        if (row_start.row == logical_cursor.row) {
+            if (logical_cursor.col < row_start.col ||
+                logical_cursor.col > row_end.col) {
+                // scrolled off to the side
+                ncplane_move_below(cursor_plane.get(), text_plane.get());
+                return;
+            }
+            vis_col = screen_x_of(vis_row, logical_cursor.col);
         }
 
-        if (vis_col == col_count) {
+        if (vis_col < col_count) {
+            ncplane_move_yx(cursor_plane.get(), (int)vis_row, (int)vis_col);
+        } else if (wrap_status == WrapStatus::WRAP) {
             ncplane_move_yx(cursor_plane.get(), (int)vis_row + 1, 0);
+            maybe_cursor_row = vis_row + 1;
         } else {
-            ncplane_move_yx(cursor_plane.get(), (int)vis_row, (int)vis_col);
+            ncplane_move_below(cursor_plane.get(), text_plane.get());
         }
-
-        // else todo the nowrap case
     }
 
-    std::vector<std::pair<Point, Point>> render_text() {
-        ncplane_erase(text_plane.get());
+    // works out which buffer points land on which visual rows, and what
+    // text each of them shows; nothing gets drawn yet
+    void layout_rows() {
         // get the text_plane size
         auto dims = get_plane_yx_dim();
         size_t row_count = dims.first, col_count = dims.second;
 
         line_points.clear();
         line_points.reserve(row_count);
+        row_texts.resize(row_count);
+        layout_xs.clear();
+        layout_offsets.clear();
+
+        // a fold may have just closed over the top of the screen, or the
+        // buffer may have shrunk under it
+        clamp_tl_corner();
 
         size_t num_lines_output = 0;
 
         size_t curr_logical_row = tl_corner.row;
         size_t curr_logical_col = tl_corner.col;
 
-        char vis_line_buf[col_count + 1];
-        // rendered_string_buf.clear();
-        std::string_view curr_logical_line;
-
-        auto into_vis_line_buf = [&, col_count]() {
+        // with wrap on, rows are cut up where get_wrap_breaks says
+        auto into_row_text = [&](std::string &row_text) {
             Point line_start_point = {curr_logical_row, curr_logical_col};
-
-            size_t buf_idx = 0;
-            if (curr_logical_col == 0) {
-                curr_logical_line = model.at(curr_logical_row);
-            }
-            while (buf_idx < col_count &&
-                   curr_logical_col < curr_logical_line.size()) {
-                if (curr_logical_line[curr_logical_col] != '\t') {
-                    vis_line_buf[buf_idx++] =
-                        curr_logical_line[curr_logical_col++];
-                    // rendered_string_buf.back().push_back(
-                    // curr_logical_line[curr_logical_col++]);
-                    continue;
-                }
-
-                if (buf_idx + 4 <= col_count) {
-                    for (size_t i = 0; i < 4; ++i) {
-                        // rendered_string_buf.back().push_back(' ');
-                        vis_line_buf[buf_idx++] = ' ';
-                    }
-                    ++curr_logical_col;
+            std::string_view line = model.at(curr_logical_row);
+            std::vector<std::pair<size_t, size_t>> const &chunk_starts =
+                get_wrap_breaks(curr_logical_row);
+            size_t chunk_idx =
+                StringUtils::chunk_of_col(chunk_starts, curr_logical_col);
+            size_t chunk_end = (chunk_idx + 1 < chunk_starts.size())
+                                   ? chunk_starts[chunk_idx + 1].first
+                                   : line.size();
+
+            row_text.clear();
+            layout_offsets.push_back(layout_xs.size());
+            layout_xs.push_back(0);
+            for (; curr_logical_col < chunk_end; ++curr_logical_col) {
+                if (line[curr_logical_col] == '\t') {
+                    row_text.append(4, ' ');
                 } else {
-                    break;
+                    row_text.push_back(line[curr_logical_col]);
                 }
+                layout_xs.push_back(row_text.size());
             }
 
             Point line_end_point = {curr_logical_row, curr_logical_col};
             line_points.push_back({line_start_point, line_end_point});
 
-            if (curr_logical_col == curr_logical_line.size()) {
-                ++curr_logical_row;
+            if (curr_logical_col == line.size()) {
+                // skips over any rows folded away under this one
+                curr_logical_row = model.next_visible_row(curr_logical_row);
                 curr_logical_col = 0;
             }
-            vis_line_buf[buf_idx] = '\0';
-            return buf_idx;
+        };
+
+        // with wrap off, every row shows the same window of columns,
+        // [left_x, left_x + col_count)
+        auto into_unwrapped_row_text = [&, col_count](std::string &row_text) {
+            std::string_view line = model.at(curr_logical_row);
+            size_t start_col = col_at_x(curr_logical_row, left_x);
+            size_t start_x = x_of_col(curr_logical_row, start_col);
+
+            row_text.clear();
+            layout_offsets.push_back(layout_xs.size());
+            layout_xs.push_back(0);
+            size_t col = start_col;
+            while (row_text.size() < col_count && col < line.size()) {
+                if (line[col] != '\t') {
+                    row_text.push_back(line[col++]);
+                    layout_xs.push_back(row_text.size());
+                    continue;
+                }
+
+                // a tab cut off by the left edge only shows what's left
+                size_t width = (col == start_col) ? 4 - (left_x - start_x) : 4;
+                if (row_text.size() + width > col_count) {
+                    break;
+                }
+                row_text.append(width, ' ');
+                layout_xs.push_back(row_text.size());
+                ++col;
+            }
+
+            line_points.push_back({Point{curr_logical_row, start_col},
+                                   Point{curr_logical_row, col}});
+            curr_logical_row = model.next_visible_row(curr_logical_row);
         };
 
         while (num_lines_output < row_count &&
                curr_logical_row < model.num_lines()) {
-            size_t num_vis_chars = into_vis_line_buf();
-
-            ncplane_putnstr_yx(text_plane.get(), (int)num_lines_output++, 0,
-                               num_vis_chars, vis_line_buf);
-            // ncplane_putnstr_yx(plane_ptr, (int)num_lines_output++, 0,
-            //                    rendered_string_buf.back().size(),
-            //                    rendered_string_buf.back().c_str());
+            if (wrap_status == WrapStatus::WRAP) {
+                into_row_text(row_texts[num_lines_output++]);
+            } else {
+                into_unwrapped_row_text(row_texts[num_lines_output++]);
+            }
+        }
+        // rows past the end of the buffer are blank
+        for (size_t idx = num_lines_output; idx < row_count; ++idx) {
+            row_texts[idx].clear();
         }
 
         if (num_lines_output == row_count) {
@@ -714,8 +984,367 @@ class TextPlane {
         } else {
             br_corner = Point(std::string::npos, std::string::npos);
         }
+    }
+
+    // see long_row_tabs
+    TabOffsets const &tabs_on(size_t row) {
+        std::string_view line = model.at(row);
+        TabOffsets *tabs = &short_row_tabs;
+        if (line.size() >= long_row_size) {
+            auto it = long_row_tabs.find(row);
+            if (it != long_row_tabs.end() &&
+                it->second.line_size == line.size()) {
+                return it->second;
+            }
+            // only what's been on screen lately is worth keeping
+            if (long_row_tabs.size() >= 256) {
+                long_row_tabs.clear();
+            }
+            tabs = &long_row_tabs[row];
+        }
+
+        tabs->line_size = line.size();
+        tabs->offsets.clear();
+        for (size_t pos = line.find('\t'); pos != std::string_view::npos;
+             pos = line.find('\t', pos + 1)) {
+            tabs->offsets.push_back(pos);
+        }
+        return *tabs;
+    }
+
+    // the screen column that byte col of row starts at, counting from the
+    // start of the row; tabs take up 4 columns
+    size_t x_of_col(size_t row, size_t col) {
+        std::vector<size_t> const &offsets = tabs_on(row).offsets;
+        size_t tabs_before =
+            (size_t)(std::lower_bound(offsets.begin(), offsets.end(), col) -
+                     offsets.begin());
+        return col + 3 * tabs_before;
+    }
+
+    // the byte of row that covers screen column x, or the end of the row if
+    // x is past it
+    size_t col_at_x(size_t row, size_t x) {
+        std::vector<size_t> const &offsets = tabs_on(row).offsets;
+        // tab idx starts at column offsets[idx] + 3 * idx, so count the
+        // ones that start at or before x
+        size_t num_tabs = 0;
+        size_t hi = offsets.size();
+        while (num_tabs < hi) {
+            size_t mid = (num_tabs + hi) / 2;
+            if (offsets[mid] + 3 * mid <= x) {
+                num_tabs = mid + 1;
+            } else {
+                hi = mid;
+            }
+        }
+        if (num_tabs > 0) {
+            size_t last_tab = offsets[num_tabs - 1];
+            if (x < last_tab + 3 * (num_tabs - 1) + 4) {
+                return last_tab;
+            }
+        }
+        return std::min(x - 3 * num_tabs, model.at(row).size());
+    }
+
+    // visual rows that row takes up with wrap on; empty ones still take
+    // up a row
+    uint32_t wrapped_rows(size_t row) {
+        return (uint32_t)get_wrap_breaks(row).size();
+    }
+
+    void ensure_wrap_index() {
+        size_t col_count = get_plane_yx_dim().second;
+        if (wrap_index_valid && wrap_index_cols == col_count &&
+            wrap_index.size() == model.num_lines()) {
+            if (wrap_index_folds_version == model.folds_version()) {
+                return;
+            }
+            // folding or unfolding only changes the rows it hid or showed
+            if (std::optional<FoldSet::RowRange> maybe_rows =
+                    model.fold_changes_since(wrap_index_folds_version)) {
+                update_wrap_index_rows(maybe_rows->first,
+                                       maybe_rows->second);
+                wrap_index_folds_version = model.folds_version();
+                return;
+            }
+        }
+
+        // rows inside folds stay at 0
+        std::vector<uint32_t> counts(model.num_lines(), 0);
+        for (size_t row = 0; row < counts.size();
+             row = model.next_visible_row(row)) {
+            counts[row] = wrapped_rows(row);
+        }
+        wrap_index.assign(counts);
+        wrap_index_valid = true;
+        wrap_index_cols = col_count;
+        wrap_index_folds_version = model.folds_version();
+    }
+
+    // recounts rows [first_row, last_row] in place; hidden rows get 0
+    void update_wrap_index_rows(size_t first_row, size_t last_row) {
+        last_row = std::min(last_row, model.num_lines() - 1);
+        if (first_row > last_row) {
+            return;
+        }
+
+        std::vector<uint32_t> counts(last_row - first_row + 1, 0);
+        size_t row = model.is_hidden(first_row)
+                         ? model.next_visible_row(first_row)
+                         : first_row;
+        for (; row <= last_row; row = model.next_visible_row(row)) {
+            counts[row - first_row] = wrapped_rows(row);
+        }
+        wrap_index.replace(first_row, last_row, counts);
+    }
+
+    // how many visual rows come before the one showing p, counting from the
+    // top of the buffer; points inside a fold show up on its header
+    size_t visual_index_of(Point p) {
+        if (model.is_hidden(p.row)) {
+            p = Point{model.visible_row_for(p.row), 0};
+        }
+        if (wrap_status == WrapStatus::NOWRAP) {
+            return model.visible_index(p.row);
+        }
+
+        ensure_wrap_index();
+        size_t chunk = StringUtils::chunk_of_col(get_wrap_breaks(p.row), p.col);
+        return wrap_index.rows_before(p.row) + chunk;
+    }
+
+    // where the visual row visual_idx starts in the buffer
+    Point point_at_visual_index(size_t visual_idx) {
+        if (wrap_status == WrapStatus::NOWRAP) {
+            return Point{model.row_at_visible_index(visual_idx), 0};
+        }
+
+        ensure_wrap_index();
+        auto [row, chunk] = wrap_index.row_at(visual_idx);
+        if (row >= model.num_lines()) {
+            // past the end, so the last row there is
+            row = model.visible_row_for(model.num_lines() - 1);
+            chunk = wrapped_rows(row) - 1;
+        }
+        return Point{row, get_wrap_breaks(row)[chunk].first};
+    }
+
+    // the visual row showing p; points hidden in a fold give the row before
+    // them. p has to be on screen.
+    size_t visual_row_of(Point p) const {
+        assert(!line_points.empty());
+        // the first row that ends at or after p, same as scanning from the
+        // top would find
+        auto it = std::partition_point(
+            line_points.begin(), line_points.end(),
+            [&](std::pair<Point, Point> const &row_points) {
+                return row_points.second < p;
+            });
+        if (it == line_points.end()) {
+            return line_points.size() - 1;
+        }
+        if (p < it->first && it != line_points.begin()) {
+            --it;
+        }
+        return (size_t)(it - line_points.begin());
+    }
+
+    // where buffer column col of visual row idx starts on screen
+    size_t screen_x_of(size_t idx, size_t col) const {
+        assert(line_points[idx].first.col <= col &&
+               col <= line_points[idx].second.col);
+        size_t offset = layout_offsets[idx];
+        return layout_xs[offset + col - line_points[idx].first.col];
+    }
+
+    // everything that ends up on a visual row: its text, the highlights and
+    // the selection covering it
+    uint64_t hash_row(size_t visual_row_idx) const {
+        RowHash hash;
+        hash.add(row_texts[visual_row_idx]);
+        if (visual_row_idx >= line_points.size()) {
+            return hash.value;
+        }
+
+        auto [row_start, row_end] = line_points[visual_row_idx];
+        if (model.has_highlights() &&
+            model.has_line_highlights(row_start.row)) {
+            for (HighlightSpan const &span :
+                 model.get_line_highlights(row_start.row)) {
+                if (span.end_col <= row_start.col ||
+                    span.start_col >= row_end.col) {
+                    continue;
+                }
+                hash.add(std::max((size_t)span.start_col, row_start.col));
+                hash.add(std::min((size_t)span.end_col, row_end.col));
+                hash.add(span.style_id);
+            }
+        }
+
+        if (model.has_anchor()) {
+            auto [anchor, cursor] =
+                std::minmax(model.get_anchor(), model.get_cursor());
+            Point lp = anchor;
+            Point rp = cursor;
+            if (lp <= row_end && rp >= row_start) {
+                hash.add(std::max(lp, row_start).col);
+                hash.add(std::min(rp, row_end).col);
+            }
+        }
+        return hash.value;
+    }
+
+    void find_damaged_rows() {
+        auto dims = get_plane_yx_dim();
+        size_t row_count = dims.first;
+        // after a resize nothing on the plane can be trusted
+        bool redraw_all = (dims != drawn_dims);
+        drawn_dims = dims;
+        drawn_row_hashes.resize(row_count);
+        dirty_rows.assign(row_count, redraw_all);
+
+        for (size_t idx = 0; idx < row_count; ++idx) {
+            uint64_t hash = hash_row(idx);
+            if (hash != drawn_row_hashes[idx]) {
+                dirty_rows[idx] = true;
+                drawn_row_hashes[idx] = hash;
+            }
+        }
+    }
+
+    // Only rewrites the rows that changed since last frame. Highlights and
+    // the selection get resolved into an array of cells first (whatever
+    // comes last wins, same as staining one after the other would), and
+    // then each run of identically styled cells is written in one go. So
+    // the number of notcurses calls depends on how many style changes are
+    // on screen, not on how many captures overlap.
+    void render_text() {
+        size_t col_count = get_plane_yx_dim().second;
+        Highlighter const &highlighter = Highlighter::get();
+
+        // highlights only set what they have, the rest comes from the base
+        nccell base_cell;
+        ncplane_base(text_plane.get(), &base_cell);
+        auto resolve = [&](Highlighter::Highlight const &hl) -> RowCell {
+            RowCell cell{.channels = 0, .stylemask = 0};
+            if (hl.has_fg_colour() || hl.has_bg_colour()) {
+                unsigned fg_r, fg_g, fg_b, bg_r, bg_g, bg_b;
+                ncchannels_fg_rgb8(base_cell.channels, &fg_r, &fg_g, &fg_b);
+                ncchannels_bg_rgb8(base_cell.channels, &bg_r, &bg_g, &bg_b);
+                if (hl.has_fg_colour()) {
+                    fg_r = hl.fg_colour->r;
+                    fg_g = hl.fg_colour->g;
+                    fg_b = hl.fg_colour->b;
+                }
+                if (hl.has_bg_colour()) {
+                    bg_r = hl.bg_colour->r;
+                    bg_g = hl.bg_colour->g;
+                    bg_b = hl.bg_colour->b;
+                }
+                cell.channels =
+                    NCCHANNELS_INITIALIZER(fg_r, fg_g, fg_b, bg_r, bg_g, bg_b);
+            }
+            cell.stylemask = hl.nc_style;
+            return cell;
+        };
+
+        std::optional<std::pair<Point, Point>> maybe_selection;
+        RowCell selection_cell{};
+        if (model.has_anchor()) {
+            auto [anchor, cursor] =
+                std::minmax(model.get_anchor(), model.get_cursor());
+            maybe_selection = {Point(anchor), Point(cursor)};
+            selection_cell = resolve(Highlighter::Highlight{
+                Highlighter::Colour{0, 0, 0},
+                Highlighter::Colour{0xff, 0xff, 0xff}, NCSTYLE_UNDERLINE});
+        }
+
+        for (size_t idx = 0; idx < row_texts.size(); ++idx) {
+            if (!dirty_rows[idx]) {
+                continue;
+            }
+            // drops last frame's text along with its styling
+            ncplane_erase_region(text_plane.get(), (int)idx, 0, 1,
+                                 (int)col_count);
+
+            std::string const &text = row_texts[idx];
+            row_cells.assign(text.size(), RowCell{.channels = 0,
+                                                  .stylemask = NCSTYLE_NONE});
+            if (idx < line_points.size()) {
+                paint_row(idx, highlighter, resolve, maybe_selection,
+                          selection_cell);
+            }
+
+            size_t run_start = 0;
+            for (size_t x = 1; x <= text.size(); ++x) {
+                if (x < text.size() && row_cells[x] == row_cells[run_start]) {
+                    continue;
+                }
+                ncplane_set_channels(text_plane.get(),
+                                     row_cells[run_start].channels);
+                ncplane_set_styles(text_plane.get(),
+                                   row_cells[run_start].stylemask);
+                ncplane_putnstr_yx(text_plane.get(), (int)idx,
+                                   (int)run_start, x - run_start,
+                                   text.data() + run_start);
+                run_start = x;
+            }
+        }
+        ncplane_set_channels(text_plane.get(), 0);
+        ncplane_set_styles(text_plane.get(), NCSTYLE_NONE);
+    }
+
+    // fills row_cells for visual row idx with the highlights and the
+    // selection on it
+    template <typename Resolve>
+    void paint_row(size_t idx, Highlighter const &highlighter,
+                   Resolve const &resolve,
+                   std::optional<std::pair<Point, Point>> maybe_selection,
+                   RowCell selection_cell) {
+        auto [row_start, row_end] = line_points[idx];
+        std::string_view line = model.at(row_start.row);
+
+        // [start_col, end_col) of the buffer row, clipped to this visual row
+        auto paint = [&](size_t start_col, size_t end_col, RowCell cell) {
+            start_col = std::max(start_col, row_start.col);
+            end_col = std::min(end_col, row_end.col);
+            if (start_col >= end_col) {
+                return;
+            }
+            size_t end_x = screen_x_of(idx, end_col);
+            for (size_t x = screen_x_of(idx, start_col); x < end_x; ++x) {
+                if (cell.channels != 0) {
+                    row_cells[x].channels = cell.channels;
+                }
+                if (cell.stylemask != NCSTYLE_NONE) {
+                    row_cells[x].stylemask = cell.stylemask;
+                }
+            }
+        };
 
-        return line_points;
+        if (model.has_highlights() &&
+            model.has_line_highlights(row_start.row)) {
+            for (HighlightSpan const &span :
+                 model.get_line_highlights(row_start.row)) {
+                if (span.style_id == Highlighter::NO_STYLE) {
+                    continue;
+                }
+                paint(span.start_col, span.end_col,
+                      resolve(highlighter[span.style_id]));
+            }
+        }
+
+        if (maybe_selection) {
+            auto [sel_start, sel_end] = *maybe_selection;
+            if (sel_start <= row_end && sel_end >= row_start) {
+                size_t start_col =
+                    (sel_start.row < row_start.row) ? 0 : sel_start.col;
+                size_t end_col =
+                    (sel_end.row > row_start.row) ? line.size() : sel_end.col;
+                paint(start_col, end_col, selection_cell);
+            }
+        }
     }
 
     std::pair<unsigned int, unsigned int> get_yx_dim(ncplane const *ptr) const {
@@ -730,47 +1359,42 @@ class TextPlane {
     }
 
     void visual_scroll_up() {
-        if (tl_corner.row == 0) {
-            return;
-        }
-        auto [num_rows, num_cols] = get_yx_dim(text_plane.get());
         if (wrap_status == WrapStatus::WRAP) {
-            if (tl_corner.col == 0) {
-                assert(tl_corner.row > 0);
-                // move tl_corner up one row and get the last line
-                --tl_corner.row;
-                auto prev_line = model.at(tl_corner.row);
-
-                tl_corner.col = (prev_line.empty()) ? 0
-                                                    : (prev_line.size() - 1) /
-                                                          num_cols * num_cols;
-
-            } else {
-                assert(tl_corner.col > 0);
-                // move tl_corner back by one chunk
-                assert(tl_corner.col % num_cols == 0);
-                tl_corner.col -= num_cols;
+            std::vector<std::pair<size_t, size_t>> const &chunk_starts =
+                get_wrap_breaks(tl_corner.row);
+            size_t chunk_idx =
+                StringUtils::chunk_of_col(chunk_starts, tl_corner.col);
+            if (chunk_idx > 0) {
+                // back by one chunk
+                tl_corner.col = chunk_starts[chunk_idx - 1].first;
+            } else if (tl_corner.row > 0) {
+                // the last chunk of the row above
+                tl_corner.row = model.prev_visible_row(tl_corner.row);
+                tl_corner.col = get_wrap_breaks(tl_corner.row).back().first;
             }
+        } else if (tl_corner.row > 0) {
+            tl_corner = Point{model.prev_visible_row(tl_corner.row), 0};
         }
-        // TODO: what happens if nowrap
     }
 
     void visual_scroll_down() {
-        if (tl_corner.row == model.num_lines() - 1) {
+        size_t next_row = model.next_visible_row(tl_corner.row);
+        if (next_row >= model.num_lines()) {
             return;
         }
-        auto [num_rows, num_cols] = get_yx_dim(text_plane.get());
         if (wrap_status == WrapStatus::WRAP) {
-            if (tl_corner.col + num_cols > model.at(tl_corner.row).size()) {
-                assert(tl_corner.row + 1 < model.num_lines());
-                tl_corner.col = 0;
-                ++tl_corner.row;
+            std::vector<std::pair<size_t, size_t>> const &chunk_starts =
+                get_wrap_breaks(tl_corner.row);
+            size_t chunk_idx =
+                StringUtils::chunk_of_col(chunk_starts, tl_corner.col);
+            if (chunk_idx + 1 < chunk_starts.size()) {
+                tl_corner.col = chunk_starts[chunk_idx + 1].first;
             } else {
-                tl_corner.col += num_cols;
+                tl_corner = Point{next_row, 0};
             }
+        } else {
+            tl_corner = Point{next_row, 0};
         }
-
-        // TODO: what happens if nowrap
     }
 
   public:
@@ -782,28 +1406,43 @@ class TextPlane {
         // will prevent awkward jumps
 
         assert(tl_corner < br_corner);
+        clamp_tl_corner();
 
         auto [num_rows, num_cols] = get_plane_yx_dim();
-        ssize_t visual_row_offset = num_visual_lines_from_tl(point);
+        if (wrap_status == WrapStatus::NOWRAP && !model.is_hidden(point.row)) {
+            // keep the point between the left and right edges too
+            size_t x = x_of_col(point.row, point.col);
+            if (x < left_x) {
+                left_x = x;
+            } else if (x >= left_x + num_cols) {
+                left_x = x - num_cols + 1;
+            }
+        }
+
+        size_t point_idx = visual_index_of(point);
+        ssize_t visual_row_offset =
+            (ssize_t)point_idx - (ssize_t)visual_index_of(tl_corner);
+        // the rows under the sticky header don't count as on screen
+        size_t top_margin = std::min<size_t>(sticky_height, num_rows - 1);
 
-        if (visual_row_offset >= 0 && visual_row_offset <= num_rows - 1) {
+        if (visual_row_offset >= (ssize_t)top_margin &&
+            visual_row_offset <= num_rows - 1) {
             // still within the screen
             return;
         }
 
-        while (visual_row_offset >= num_rows) {
-            visual_scroll_down();
-            --visual_row_offset;
-        }
-
-        while (visual_row_offset < 0) {
-            visual_scroll_up();
-            ++visual_row_offset;
+        // jump straight there: the point ends up on the bottom row when
+        // going down, and on the first row below the header when going up
+        if (visual_row_offset >= num_rows) {
+            tl_corner = point_at_visual_index(point_idx - (num_rows - 1));
+        } else {
+            tl_corner = point_at_visual_index(
+                point_idx - std::min(point_idx, top_margin));
         }
     }
 
     void hide_cursor() {
-        ncplane_move_below(text_plane.get(), cursor_plane.get());
+        ncplane_move_below(cursor_plane.get(), text_plane.get());
     }
 
     void show_cursor() {
@@ -904,30 +1543,183 @@ struct BottomPane {
 };
 
 struct MainPane {
+    // How the text planes tile the pane. Leaves show a plane, and splits
+    // give half their area to each child. Leaves remember where they were
+    // last put, so that a split or a close only touches the planes whose
+    // area actually changed.
+    struct Layout {
+        std::optional<Split> maybe_split;
+        std::unique_ptr<Layout> first;
+        std::unique_ptr<Layout> second;
+
+        TextPlane *plane_ptr; // leaves only
+        int y;
+        int x;
+        unsigned int num_rows;
+        unsigned int num_cols;
+
+        explicit Layout(TextPlane *tp)
+            : plane_ptr(tp),
+              y(0),
+              x(0),
+              num_rows(0),
+              num_cols(0) {
+        }
+    };
+
+    // smallest a plane can get, line numbers included
+    static constexpr unsigned int min_rows = 1;
+    static constexpr unsigned int min_cols = 8;
+
     NCPlane main_plane;
     // i need them to be address stable so i can't just use std::vector
-    std::deque<TextPlane> text_planes;
-    size_t active_idx;
+    std::list<TextPlane> text_planes;
+    std::unique_ptr<Layout> layout_root;
+    TextPlane *active_ptr;
 
     MainPane(NCPlane &base_plane, int y, int x, unsigned height, unsigned width)
         : main_plane(base_plane, y, x, height, width),
-          active_idx(0) {
+          active_ptr(nullptr) {
     }
 
     // adds a new text state to the current pane
     TextPlane *add_text_plane(TextPlaneModel tpm) {
         text_planes.emplace_back(main_plane, tpm, main_plane.height(),
                                  main_plane.width());
-        active_idx = text_planes.size() - 1;
+        layout_root = std::make_unique<Layout>(&text_planes.back());
+        relayout();
+        set_active(&text_planes.back());
+        return &text_planes.back();
+    }
+
+    // cuts the area of existing in two, and puts a new plane showing tpm in
+    // the second half. Returns nullptr if there isn't room.
+    TextPlane *split_text_plane(TextPlane *existing, Split split,
+                                TextPlaneModel tpm) {
+        std::unique_ptr<Layout> *slot = find_slot(layout_root, existing);
+        if (!slot) {
+            return nullptr;
+        }
+        Layout &leaf = **slot;
+        if ((split == Split::HORIZONTAL && leaf.num_rows < 2 * min_rows) ||
+            (split == Split::VERTICAL && leaf.num_cols < 2 * min_cols)) {
+            return nullptr;
+        }
+
+        text_planes.emplace_back(main_plane, tpm, leaf.num_rows,
+                                 leaf.num_cols);
+        auto node = std::make_unique<Layout>(nullptr);
+        node->maybe_split = split;
+        node->first = std::move(*slot);
+        node->second = std::make_unique<Layout>(&text_planes.back());
+        *slot = std::move(node);
+        relayout();
         return &text_planes.back();
     }
 
+    // its sibling takes over its area; the last plane can't be closed
+    bool close_text_plane(TextPlane *plane) {
+        std::unique_ptr<Layout> *parent_slot =
+            find_parent_slot(layout_root, plane);
+        if (!parent_slot) {
+            return false;
+        }
+        Layout &parent = **parent_slot;
+        bool is_first = !parent.first->maybe_split &&
+                        parent.first->plane_ptr == plane;
+        *parent_slot = std::move(is_first ? parent.second : parent.first);
+
+        if (active_ptr == plane) {
+            active_ptr = nullptr;
+        }
+        text_planes.remove_if(
+            [&](TextPlane const &text_plane) { return &text_plane == plane; });
+        relayout();
+        return true;
+    }
+
+    // the one that gets the cursor
+    void set_active(TextPlane *plane) {
+        if (active_ptr && active_ptr != plane) {
+            active_ptr->hide_cursor();
+        }
+        active_ptr = plane;
+    }
+
     void hide_cursor() {
-        text_planes.at(active_idx).hide_cursor();
+        active_ptr->hide_cursor();
     }
 
     void show_cursor() {
-        text_planes.at(active_idx).show_cursor();
+        active_ptr->show_cursor();
+    }
+
+  private:
+    void relayout() {
+        if (layout_root) {
+            place(*layout_root, 0, 0, main_plane.height(), main_plane.width());
+        }
+    }
+
+    static void place(Layout &node, int y, int x, unsigned int num_rows,
+                      unsigned int num_cols) {
+        if (!node.maybe_split) {
+            if (node.y == y && node.x == x && node.num_rows == num_rows &&
+                node.num_cols == num_cols) {
+                return;
+            }
+            node.y = y;
+            node.x = x;
+            node.num_rows = num_rows;
+            node.num_cols = num_cols;
+            node.plane_ptr->move_resize(y, x, num_rows, num_cols);
+            return;
+        }
+
+        if (*node.maybe_split == Split::HORIZONTAL) {
+            unsigned int first_rows = num_rows / 2;
+            place(*node.first, y, x, first_rows, num_cols);
+            place(*node.second, y + (int)first_rows, x, num_rows - first_rows,
+                  num_cols);
+        } else {
+            unsigned int first_cols = num_cols / 2;
+            place(*node.first, y, x, num_rows, first_cols);
+            place(*node.second, y, x + (int)first_cols, num_rows,
+                  num_cols - first_cols);
+        }
+    }
+
+    // the unique_ptr holding the leaf that shows plane
+    static std::unique_ptr<Layout> *find_slot(std::unique_ptr<Layout> &node,
+                                              TextPlane const *plane) {
+        if (!node) {
+            return nullptr;
+        }
+        if (!node->maybe_split) {
+            return (node->plane_ptr == plane) ? &node : nullptr;
+        }
+        if (std::unique_ptr<Layout> *slot = find_slot(node->first, plane)) {
+            return slot;
+        }
+        return find_slot(node->second, plane);
+    }
+
+    // the unique_ptr holding the split right above the leaf showing plane
+    static std::unique_ptr<Layout> *
+    find_parent_slot(std::unique_ptr<Layout> &node, TextPlane const *plane) {
+        if (!node || !node->maybe_split) {
+            return nullptr;
+        }
+        for (Layout const *child : {node->first.get(), node->second.get()}) {
+            if (!child->maybe_split && child->plane_ptr == plane) {
+                return &node;
+            }
+        }
+        if (std::unique_ptr<Layout> *slot =
+                find_parent_slot(node->first, plane)) {
+            return slot;
+        }
+        return find_parent_slot(node->second, plane);
     }
 };
 
@@ -943,12 +1735,15 @@ class View {
     MainPane main_pane;
     BottomPane bottom_pane;
 
+    FrameWriter frame_writer;
+
   public:
     View(notcurses *nc, unsigned height, unsigned width)
         : nc_ptr(nc),
           ncplane(notcurses_stdplane(nc), 0, 0, height, width),
           main_pane(ncplane, 0, 0, height - 1, width),
-          bottom_pane(ncplane, (int)height - 1, 0, 1, width) {
+          bottom_pane(ncplane, (int)height - 1, 0, 1, width),
+          frame_writer(notcurses_stdplane(nc)) {
     }
 
     View(View const &) = delete;
@@ -962,6 +1757,21 @@ class View {
         return main_pane.add_text_plane(tpm);
     }
 
+    // see MainPane::split_text_plane
+    TextPlane *split_text_plane(TextPlane *existing, Split split,
+                                TextPlaneModel tpm) {
+        return main_pane.split_text_plane(existing, split, tpm);
+    }
+
+    bool close_text_plane(TextPlane *plane) {
+        return main_pane.close_text_plane(plane);
+    }
+
+    // moves the cursor over to plane's pane
+    void set_active_text_plane(TextPlane *plane) {
+        main_pane.set_active(plane);
+    }
+
     void set_prompt_plane(BottomPlaneModel bpm) {
         bottom_pane.set_model(bpm);
     }
@@ -999,8 +1809,10 @@ class View {
         return text_plane_list.at(active_text_plane_idx).line_points;
     }
 
+    // the terminal write happens on frame_writer's thread; this only waits
+    // for it if the terminal has fallen a couple of frames behind
     void refresh_screen() {
-        notcurses_render(nc_ptr);
+        frame_writer.submit();
     }
 
     BottomPane *get_bottom_pane_ptr() {